@@ -233,6 +233,10 @@ static int input_get_disposition(struct input_dev *dev,
 			if (!!test_bit(code, dev->key) != !!value) {
 
 				__change_bit(code, dev->key);
+				if (value)
+					__input_to_compat(dev)->keys_pressed++;
+				else
+					__input_to_compat(dev)->keys_pressed--;
 				disposition = INPUT_PASS_TO_HANDLERS;
 			}
 		}
@@ -375,17 +379,67 @@ static void input_handle_event(struct input_dev *dev,
 void input_event(struct input_dev *dev,
 		 unsigned int type, unsigned int code, int value)
 {
+	struct __compat_input_dev *c_dev = __input_to_compat(dev);
 	unsigned long flags;
+	bool batched;
 
 	if (is_event_supported(type, dev->evbit, EV_MAX)) {
 
-		spin_lock_irqsave(&dev->event_lock, flags);
+		local_irq_save(flags);
+		/*
+		 * With interrupts disabled, only the owner of the batch can
+		 * run on batch_cpu, and it already holds event_lock.
+		 */
+		batched = c_dev->batch_cpu == smp_processor_id();
+		if (!batched)
+			spin_lock(&dev->event_lock);
 		input_handle_event(dev, type, code, value);
-		spin_unlock_irqrestore(&dev->event_lock, flags);
+		if (!batched)
+			spin_unlock(&dev->event_lock);
+		local_irq_restore(flags);
 	}
 }
 EXPORT_SYMBOL(input_event);
 
+/**
+ * input_event_batch_begin() - start a batch of input events
+ * @dev: device that generates the events
+ *
+ * Takes dev->event_lock once for all the events reported until
+ * input_event_batch_end() is called. input_event() and the input_mt_*()
+ * helpers used in between do not take the lock again, so a whole frame
+ * is queued in the values buffer with a single lock round-trip.
+ *
+ * The caller must not sleep nor report events of this device from
+ * another context before calling input_event_batch_end().
+ */
+void input_event_batch_begin(struct input_dev *dev)
+{
+	struct __compat_input_dev *c_dev = __input_to_compat(dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	c_dev->batch_flags = flags;
+	c_dev->batch_cpu = smp_processor_id();
+}
+EXPORT_SYMBOL(input_event_batch_begin);
+
+/**
+ * input_event_batch_end() - terminate a batch of input events
+ * @dev: device that generated the events
+ *
+ * Releases dev->event_lock taken by input_event_batch_begin().
+ */
+void input_event_batch_end(struct input_dev *dev)
+{
+	struct __compat_input_dev *c_dev = __input_to_compat(dev);
+	unsigned long flags = c_dev->batch_flags;
+
+	c_dev->batch_cpu = -1;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+}
+EXPORT_SYMBOL(input_event_batch_end);
+
 /**
  * compat:
  * - rely on internal input module, so undefine and declare the internal
@@ -428,6 +482,7 @@ struct input_dev *compat_input_allocate_device(void)
 		spin_lock_init(&dev->event_lock);
 		INIT_LIST_HEAD(&dev->h_list);
 		INIT_LIST_HEAD(&dev->node);
+		_dev->batch_cpu = -1;
 
 /** compat: comment out __module_get(THIS_MODULE); */
 	}
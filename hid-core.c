@@ -27,9 +27,13 @@
 #include <asm/byteorder.h>
 #include <linux/input.h>
 #include <linux/wait.h>
-#include <linux/vmalloc.h>
 #include <linux/sched.h>
 #include <linux/semaphore.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
 
 #include <linux/hid.h>
 #include <linux/hiddev.h>
@@ -87,29 +91,109 @@ struct hid_report *hid_register_report(struct hid_device *device, unsigned type,
 }
 EXPORT_SYMBOL_GPL(hid_register_report);
 
+/* Allocation size of a field, with its usages, values and bitmaps */
+static size_t hid_field_alloc_size(unsigned usages, unsigned values,
+				   unsigned flags)
+{
+	unsigned bitmap_longs = 0;
+
+	if (!(flags & HID_MAIN_ITEM_VARIABLE))
+		bitmap_longs = BITS_TO_LONGS(usages);
+
+	return sizeof(struct hid_field) +
+		2 * bitmap_longs * sizeof(unsigned long) +
+		usages * sizeof(struct hid_usage) +
+		2 * values * sizeof(unsigned);
+}
+
 /*
- * Register a new field for this report.
+ * The field array of a report grows while the descriptor is parsed, and is
+ * trimmed to its exact size by hid_trim_fields() once parsing is done.
+ */
+
+static int hid_grow_fields(struct hid_report *report)
+{
+	struct hid_field **field;
+	unsigned size;
+
+	size = report->field_size ? 2 * report->field_size : 4;
+	size = min_t(unsigned, size, HID_MAX_FIELDS);
+
+	field = krealloc(report->field, size * sizeof(*field), GFP_KERNEL);
+	if (!field)
+		return -ENOMEM;
+
+	report->field = field;
+	report->field_size = size;
+	return 0;
+}
+
+static void hid_trim_fields(struct hid_device *device)
+{
+	struct hid_report *report;
+	struct hid_field **field;
+	unsigned i;
+
+	for (i = 0; i < HID_REPORT_TYPES; i++) {
+		list_for_each_entry(report, &device->report_enum[i].report_list,
+				    list) {
+			if (report->field_size == report->maxfield)
+				continue;
+
+			field = NULL;
+			if (report->maxfield) {
+				field = kmemdup(report->field,
+						report->maxfield * sizeof(*field),
+						GFP_KERNEL);
+				if (!field)
+					continue;	/* keep the larger array */
+			}
+
+			kfree(report->field);
+			report->field = field;
+			report->field_size = report->maxfield;
+		}
+	}
+}
+
+/*
+ * Register a new field for this report. Array fields also get two
+ * bitmaps of maxusage bits, used to compute the pressed and released
+ * usages between two reports.
  */
 
-static struct hid_field *hid_register_field(struct hid_report *report, unsigned usages, unsigned values)
+static struct hid_field *hid_register_field(struct hid_report *report, unsigned usages,
+					    unsigned values, unsigned flags)
 {
 	struct hid_field *field;
+	unsigned bitmap_longs = 0;
 
 	if (report->maxfield == HID_MAX_FIELDS) {
 		hid_err(report->device, "too many fields in report\n");
 		return NULL;
 	}
 
-	field = kzalloc((sizeof(struct hid_field) +
-			 usages * sizeof(struct hid_usage) +
-			 values * sizeof(unsigned)), GFP_KERNEL);
+	if (report->maxfield == report->field_size &&
+	    hid_grow_fields(report))
+		return NULL;
+
+	if (!(flags & HID_MAIN_ITEM_VARIABLE))
+		bitmap_longs = BITS_TO_LONGS(usages);
+
+	field = kzalloc(hid_field_alloc_size(usages, values, flags), GFP_KERNEL);
 	if (!field)
 		return NULL;
 
 	field->index = report->maxfield++;
 	report->field[field->index] = field;
-	field->usage = (struct hid_usage *)(field + 1);
+	field->usage = (struct hid_usage *)((unsigned long *)(field + 1) +
+					    2 * bitmap_longs);
 	field->value = (s32 *)(field->usage + usages);
+	field->new_value = (s32 *)(field->value + values);
+	if (bitmap_longs) {
+		field->usage_bits = (unsigned long *)(field + 1);
+		field->new_usage_bits = field->usage_bits + bitmap_longs;
+	}
 	field->report = report;
 
 	return field;
@@ -124,7 +208,7 @@ static int open_collection(struct hid_parser *parser, unsigned type)
 	struct hid_collection *collection;
 	unsigned usage;
 
-	usage = parser->local.usage[0];
+	usage = parser->local.usage_index ? parser->local.usage[0] : 0;
 
 	if (parser->collection_stack_ptr == HID_COLLECTION_STACK_SIZE) {
 		hid_err(parser->device, "collection stack overflow\n");
@@ -196,6 +280,70 @@ static unsigned hid_lookup_collection(struct hid_parser *parser, unsigned type)
 	return 0; /* we know nothing about this usage type */
 }
 
+/*
+ * Grow the temporary usage tables. Most descriptors only need a few dozen
+ * entries, so they start small instead of at HID_MAX_USAGES.
+ */
+
+static int hid_grow_usages(struct hid_parser *parser)
+{
+	struct hid_local *local = &parser->local;
+	unsigned size;
+	unsigned *usage, *collection_index;
+
+	size = local->usage_size ? 2 * local->usage_size :
+		HID_DEFAULT_NUM_USAGES;
+	size = min_t(unsigned, size, HID_MAX_USAGES);
+
+	usage = krealloc(local->usage, size * sizeof(unsigned), GFP_KERNEL);
+	if (!usage)
+		return -ENOMEM;
+	local->usage = usage;
+
+	collection_index = krealloc(local->collection_index,
+				    size * sizeof(unsigned), GFP_KERNEL);
+	if (!collection_index)
+		return -ENOMEM;
+	local->collection_index = collection_index;
+
+	local->usage_size = size;
+	return 0;
+}
+
+/*
+ * Reset the local parser environment, keeping the usage tables around
+ * for the next main item.
+ */
+
+static void hid_reset_local(struct hid_parser *parser)
+{
+	struct hid_local *local = &parser->local;
+
+	local->usage_index = 0;
+	local->usage_minimum = 0;
+	local->delimiter_depth = 0;
+	local->delimiter_branch = 0;
+}
+
+static struct hid_parser *hid_alloc_parser(struct hid_device *device)
+{
+	struct hid_parser *parser;
+
+	parser = kzalloc(sizeof(struct hid_parser), GFP_KERNEL);
+	if (parser)
+		parser->device = device;
+	return parser;
+}
+
+static void hid_free_parser(struct hid_parser *parser)
+{
+	if (!parser)
+		return;
+	kfree(parser->local.usage);
+	kfree(parser->local.collection_index);
+	kfree(parser);
+}
+
 /*
  * Add a usage to the temporary parser table.
  */
@@ -206,6 +354,11 @@ static int hid_add_usage(struct hid_parser *parser, unsigned usage)
 		hid_err(parser->device, "usage index exceeded\n");
 		return -1;
 	}
+	if (parser->local.usage_index >= parser->local.usage_size &&
+	    hid_grow_usages(parser)) {
+		hid_err(parser->device, "failed to grow usage array\n");
+		return -1;
+	}
 	parser->local.usage[parser->local.usage_index] = usage;
 	parser->local.collection_index[parser->local.usage_index] =
 		parser->collection_stack_ptr ?
@@ -214,6 +367,42 @@ static int hid_add_usage(struct hid_parser *parser, unsigned usage)
 	return 0;
 }
 
+/*
+ * Decode plans of input fields. The layout of a field never changes once
+ * the report descriptor has been parsed, so pick the cheapest way to
+ * fetch its values here instead of for each incoming report.
+ */
+
+#define HID_DECODE_UNSIGNED	0	/* generic bit field extraction */
+#define HID_DECODE_SIGNED	1	/* generic extraction + sign extension */
+#define HID_DECODE_U8		2	/* byte aligned 8 bits values */
+#define HID_DECODE_S8		3
+#define HID_DECODE_U16		4	/* byte aligned 16 bits values */
+#define HID_DECODE_S16		5
+#define HID_DECODE_32		6	/* byte aligned 32 bits values */
+
+static void hid_setup_field_decode(struct hid_field *field)
+{
+	bool is_signed = field->logical_minimum < 0;
+
+	field->decode = is_signed ? HID_DECODE_SIGNED : HID_DECODE_UNSIGNED;
+
+	if (field->report_offset & 7)
+		return;
+
+	switch (field->report_size) {
+	case 8:
+		field->decode = is_signed ? HID_DECODE_S8 : HID_DECODE_U8;
+		break;
+	case 16:
+		field->decode = is_signed ? HID_DECODE_S16 : HID_DECODE_U16;
+		break;
+	case 32:
+		field->decode = HID_DECODE_32;
+		break;
+	}
+}
+
 /*
  * Register a new field for this report.
  */
@@ -254,7 +443,8 @@ static int hid_add_field(struct hid_parser *parser, unsigned report_type, unsign
 	usages = max_t(unsigned, parser->local.usage_index,
 				 parser->global.report_count);
 
-	field = hid_register_field(report, usages, parser->global.report_count);
+	field = hid_register_field(report, usages, parser->global.report_count,
+				   flags);
 	if (!field)
 		return 0;
 
@@ -286,6 +476,8 @@ static int hid_add_field(struct hid_parser *parser, unsigned report_type, unsign
 	field->unit_exponent = parser->global.unit_exponent;
 	field->unit = parser->global.unit;
 
+	hid_setup_field_decode(field);
+
 	return 0;
 }
 
@@ -537,7 +729,7 @@ static int hid_parser_main(struct hid_parser *parser, struct hid_item *item)
 		ret = 0;
 	}
 
-	memset(&parser->local, 0, sizeof(parser->local));	/* Reset the local parser environment */
+	hid_reset_local(parser);
 
 	return ret;
 }
@@ -553,9 +745,9 @@ static int hid_parser_reserved(struct hid_parser *parser, struct hid_item *item)
 }
 
 /*
- * Free a report and all registered fields. The field->usage and
- * field->value table's are allocated behind the field, so we need
- * only to free(field) itself.
+ * Free a report and all registered fields. The field->usage,
+ * field->value and field->new_value table's are allocated behind the
+ * field, so we need only to free(field) itself.
  */
 
 static void hid_free_report(struct hid_report *report)
@@ -564,6 +756,7 @@ static void hid_free_report(struct hid_report *report)
 
 	for (n = 0; n < report->maxfield; n++)
 		kfree(report->field[n]);
+	kfree(report->field);
 	kfree(report);
 }
 
@@ -575,6 +768,8 @@ static void hid_close_report(struct hid_device *device)
 {
 	unsigned i, j;
 
+	device->dispatch_cached = false;
+
 	for (i = 0; i < HID_REPORT_TYPES; i++) {
 		struct hid_report_enum *report_enum = device->report_enum + i;
 
@@ -607,9 +802,17 @@ static void hid_close_report(struct hid_device *device)
 static void hid_device_release(struct device *dev)
 {
 	struct hid_device *hid = container_of(dev, struct hid_device, dev);
+	unsigned i;
 
 	hid_close_report(hid);
 	kfree(hid->dev_rdesc);
+	for (i = hid->staging_tail; i != hid->staging_head;
+	     i = (i + 1) % HID_STAGING_SLOTS)
+		if (hid->staging[i].allocated)
+			kfree(hid->staging[i].data);
+	kfree(hid->staging);
+	kfree(hid->staging_pool);
+	kfree(hid->staging_bounce);
 	kfree(hid);
 }
 
@@ -729,8 +932,7 @@ static int hid_scan_main(struct hid_parser *parser, struct hid_item *item)
 		break;
 	}
 
-	/* Reset the local parser environment */
-	memset(&parser->local, 0, sizeof(parser->local));
+	hid_reset_local(parser);
 
 	return 0;
 }
@@ -754,11 +956,10 @@ static int hid_scan_report(struct hid_device *hid)
 		hid_parser_reserved
 	};
 
-	parser = vzalloc(sizeof(struct hid_parser));
+	parser = hid_alloc_parser(hid);
 	if (!parser)
 		return -ENOMEM;
 
-	parser->device = hid;
 	hid->group = HID_GROUP_GENERIC;
 
 	/*
@@ -776,7 +977,7 @@ static int hid_scan_report(struct hid_device *hid)
 	    (hid->group == HID_GROUP_MULTITOUCH))
 		hid->group = HID_GROUP_MULTITOUCH_WIN_8;
 
-	vfree(parser);
+	hid_free_parser(parser);
 	return 0;
 }
 
@@ -858,6 +1059,271 @@ struct hid_report *hid_validate_values(struct hid_device *hid,
 }
 EXPORT_SYMBOL_GPL(hid_validate_values);
 
+/*
+ * Cache of parsed report descriptors. Many identical devices (e.g. a wall
+ * of touch panels) share the same descriptor, so the result of the first
+ * parse is kept and copied for the next devices instead of running the
+ * parser again. The key is the descriptor after report_fixup(), which is
+ * all the parser depends on; each device still gets its own copy of the
+ * reports and fields, as drivers and the input path modify them.
+ */
+
+#define HID_DESC_CACHE_SIZE	16
+
+struct hid_parsed_desc {
+	struct list_head list;
+	u32 hash;
+	__u8 *rdesc;
+	unsigned rsize;
+	struct hid_report_enum report_enum[HID_REPORT_TYPES];
+	struct hid_collection *collection;
+	unsigned collection_size;
+	unsigned maxcollection;
+	unsigned maxapplication;
+};
+
+static LIST_HEAD(hid_desc_cache);
+static unsigned hid_desc_cache_count;
+static DEFINE_MUTEX(hid_desc_cache_lock);
+
+static void hid_free_parsed_desc(struct hid_parsed_desc *desc)
+{
+	struct hid_report *report, *tmp;
+	unsigned i;
+
+	for (i = 0; i < HID_REPORT_TYPES; i++)
+		list_for_each_entry_safe(report, tmp,
+					 &desc->report_enum[i].report_list, list)
+			hid_free_report(report);
+
+	kfree(desc->collection);
+	kfree(desc->rdesc);
+	kfree(desc);
+}
+
+/*
+ * Copy the reports of @src into the empty @dst, owned by @device (NULL for
+ * cache entries). The field values are not copied, they start at zero.
+ */
+static int hid_copy_reports(struct hid_report_enum *dst,
+			    const struct hid_report_enum *src,
+			    struct hid_device *device)
+{
+	struct hid_report *sreport, *report;
+	struct hid_field *sfield, *field;
+	size_t size;
+	unsigned i;
+
+	dst->numbered = src->numbered;
+
+	list_for_each_entry(sreport, &src->report_list, list) {
+		report = kmemdup(sreport, sizeof(*report), GFP_KERNEL);
+		if (!report)
+			return -ENOMEM;
+
+		report->field = NULL;
+		report->maxfield = 0;
+		report->field_size = 0;
+		if (sreport->maxfield) {
+			report->field = kcalloc(sreport->maxfield,
+						sizeof(*report->field),
+						GFP_KERNEL);
+			if (!report->field) {
+				kfree(report);
+				return -ENOMEM;
+			}
+			report->field_size = sreport->maxfield;
+		}
+
+		report->dispatch = 0;
+		report->mode = HID_REPORT_MODE_BOTH;
+		report->device = device;
+		dst->report_id_hash[report->id] = report;
+		list_add_tail(&report->list, &dst->report_list);
+
+		for (i = 0; i < sreport->maxfield; i++) {
+			sfield = sreport->field[i];
+			size = hid_field_alloc_size(sfield->maxusage,
+						    sfield->report_count,
+						    sfield->flags);
+			field = kzalloc(size, GFP_KERNEL);
+			if (!field)
+				return -ENOMEM;
+
+			/* header and usages; the arrays live behind the field */
+			*field = *sfield;
+			field->usage = (void *)field +
+				((void *)sfield->usage - (void *)sfield);
+			memcpy(field->usage, sfield->usage,
+			       sfield->maxusage * sizeof(*field->usage));
+			field->value = (s32 *)(field->usage + field->maxusage);
+			field->new_value = field->value + field->report_count;
+			if (sfield->usage_bits) {
+				field->usage_bits = (unsigned long *)(field + 1);
+				field->new_usage_bits = field->usage_bits +
+					BITS_TO_LONGS(field->maxusage);
+			}
+			field->report = report;
+			field->hidinput = NULL;
+
+			report->field[i] = field;
+			report->maxfield = i + 1;
+		}
+	}
+
+	return 0;
+}
+
+static int hid_copy_collections(struct hid_collection **dst,
+				struct hid_collection *src, unsigned size)
+{
+	*dst = kmemdup(src, size * sizeof(*src), GFP_KERNEL);
+	return *dst ? 0 : -ENOMEM;
+}
+
+/*
+ * Fill @device from a cached parse of its descriptor.
+ * Returns -ENOENT if the descriptor is not in the cache.
+ */
+static int hid_open_cached_report(struct hid_device *device, u32 hash)
+{
+	struct hid_parsed_desc *desc;
+	unsigned i;
+	int ret = -ENOENT;
+
+	mutex_lock(&hid_desc_cache_lock);
+
+	list_for_each_entry(desc, &hid_desc_cache, list) {
+		if (desc->hash != hash || desc->rsize != device->rsize ||
+		    memcmp(desc->rdesc, device->rdesc, desc->rsize))
+			continue;
+
+		ret = hid_copy_collections(&device->collection,
+					   desc->collection,
+					   desc->collection_size);
+		if (ret)
+			break;
+		device->collection_size = desc->collection_size;
+		device->maxcollection = desc->maxcollection;
+		device->maxapplication = desc->maxapplication;
+
+		for (i = 0; i < HID_REPORT_TYPES && !ret; i++)
+			ret = hid_copy_reports(device->report_enum + i,
+					       desc->report_enum + i, device);
+
+		/* most recently used first */
+		list_move(&desc->list, &hid_desc_cache);
+		break;
+	}
+
+	mutex_unlock(&hid_desc_cache_lock);
+	return ret;
+}
+
+/* Keep the freshly parsed layout of @device for the next identical device */
+static void hid_cache_report(struct hid_device *device, u32 hash)
+{
+	struct hid_parsed_desc *desc;
+	unsigned i;
+
+	desc = kzalloc(sizeof(*desc), GFP_KERNEL);
+	if (!desc)
+		return;
+
+	desc->hash = hash;
+	desc->rsize = device->rsize;
+	for (i = 0; i < HID_REPORT_TYPES; i++)
+		INIT_LIST_HEAD(&desc->report_enum[i].report_list);
+
+	desc->rdesc = kmemdup(device->rdesc, device->rsize, GFP_KERNEL);
+	if (!desc->rdesc ||
+	    hid_copy_collections(&desc->collection, device->collection,
+				 device->collection_size))
+		goto err;
+	desc->collection_size = device->collection_size;
+	desc->maxcollection = device->maxcollection;
+	desc->maxapplication = device->maxapplication;
+
+	for (i = 0; i < HID_REPORT_TYPES; i++)
+		if (hid_copy_reports(desc->report_enum + i,
+				     device->report_enum + i, NULL))
+			goto err;
+
+	mutex_lock(&hid_desc_cache_lock);
+	list_add(&desc->list, &hid_desc_cache);
+	if (++hid_desc_cache_count > HID_DESC_CACHE_SIZE) {
+		desc = list_entry(hid_desc_cache.prev, struct hid_parsed_desc,
+				  list);
+		list_del(&desc->list);
+		hid_desc_cache_count--;
+	} else {
+		desc = NULL;
+	}
+	mutex_unlock(&hid_desc_cache_lock);
+
+	/* evicted entry, if any */
+	if (desc)
+		hid_free_parsed_desc(desc);
+	return;
+
+err:
+	hid_free_parsed_desc(desc);
+}
+
+static void hid_flush_desc_cache(void)
+{
+	struct hid_parsed_desc *desc, *tmp;
+
+	list_for_each_entry_safe(desc, tmp, &hid_desc_cache, list)
+		hid_free_parsed_desc(desc);
+	INIT_LIST_HEAD(&hid_desc_cache);
+	hid_desc_cache_count = 0;
+}
+
+/*
+ * Size the staging slots from the parsed input reports, so that the longest
+ * one fits. Staged reports are copied to hid->staging_bounce before being
+ * processed, which leaves room for the zero padding hid_report_raw_event()
+ * adds to short reports and for extract() reading past the data.
+ *
+ * The pool is only set up once: nothing can reference it before it exists,
+ * while a later parse could race with reports staged in the old one. Reports
+ * that do not fit are staged in a buffer of their own.
+ */
+static void hid_setup_staging(struct hid_device *device)
+{
+	struct hid_report_enum *report_enum = device->report_enum + HID_INPUT_REPORT;
+	struct hid_report *report;
+	unsigned int stride = HID_MIN_BUFFER_SIZE;
+	unsigned int len;
+	unsigned long flags;
+	u8 *pool;
+
+	if (device->staging_pool)
+		return;
+
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		if (!report->size)
+			continue;
+		len = ((report->size - 1) >> 3) + 1;
+		if (len > HID_MAX_BUFFER_SIZE)
+			len = HID_MAX_BUFFER_SIZE;
+		len += report_enum->numbered;
+		if (stride < len)
+			stride = len;
+	}
+	stride = ALIGN(stride, sizeof(long));
+
+	pool = kmalloc(HID_STAGING_SLOTS * stride, GFP_KERNEL);
+	if (!pool)
+		return;
+
+	spin_lock_irqsave(&device->staging_lock, flags);
+	device->staging_stride = stride;
+	device->staging_pool = pool;
+	spin_unlock_irqrestore(&device->staging_lock, flags);
+}
+
 /**
  * hid_open_report - open a driver-specific device report
  *
@@ -878,6 +1344,7 @@ int hid_open_report(struct hid_device *device)
 	__u8 *start;
 	__u8 *buf;
 	__u8 *end;
+	u32 hash;
 	int ret;
 	static int (*dispatch_type[])(struct hid_parser *parser,
 				      struct hid_item *item) = {
@@ -912,14 +1379,24 @@ int hid_open_report(struct hid_device *device)
 	device->rdesc = start;
 	device->rsize = size;
 
-	parser = vzalloc(sizeof(struct hid_parser));
+	hash = jhash(start, size, 0);
+	ret = hid_open_cached_report(device, hash);
+	if (!ret) {
+		hid_setup_staging(device);
+		device->status |= HID_STAT_PARSED;
+		return 0;
+	}
+	if (ret != -ENOENT) {
+		hid_close_report(device);
+		return ret;
+	}
+
+	parser = hid_alloc_parser(device);
 	if (!parser) {
 		ret = -ENOMEM;
 		goto err;
 	}
 
-	parser->device = device;
-
 	end = start + size;
 
 	device->collection = kcalloc(HID_DEFAULT_NUM_COLLECTIONS,
@@ -954,7 +1431,10 @@ int hid_open_report(struct hid_device *device)
 				hid_err(device, "unbalanced delimiter at end of report description\n");
 				goto err;
 			}
-			vfree(parser);
+			hid_free_parser(parser);
+			hid_trim_fields(device);
+			hid_cache_report(device, hash);
+			hid_setup_staging(device);
 			device->status |= HID_STAT_PARSED;
 			return 0;
 		}
@@ -962,7 +1442,7 @@ int hid_open_report(struct hid_device *device)
 
 	hid_err(device, "item fetching failed at offset %d\n", (int)(end - start));
 err:
-	vfree(parser);
+	hid_free_parser(parser);
 	hid_close_report(device);
 	return ret;
 }
@@ -1063,19 +1543,6 @@ static void implement(const struct hid_device *hid, __u8 *report,
 	put_unaligned_le64(x, report);
 }
 
-/*
- * Search an array for a value.
- */
-
-static int search(__s32 *array, __s32 value, unsigned n)
-{
-	while (n--) {
-		if (*array++ == value)
-			return 0;
-	}
-	return -1;
-}
-
 /**
  * hid_match_report - check if driver's raw_event should be called
  *
@@ -1125,6 +1592,58 @@ static int hid_match_usage(struct hid_device *hid, struct hid_usage *usage)
 	return 0;
 }
 
+/*
+ * Once the driver is connected, its usage_table and report_table do not
+ * change, so the match results are computed once in hid_connect() and the
+ * input path only tests a flag.
+ */
+static void hid_setup_dispatch(struct hid_device *hid)
+{
+	struct hid_report_enum *report_enum;
+	struct hid_report *report;
+	struct hid_field *field;
+	unsigned int t, i, j;
+
+	for (t = 0; t < HID_REPORT_TYPES; t++) {
+		report_enum = hid->report_enum + t;
+		list_for_each_entry(report, &report_enum->report_list, list) {
+			report->dispatch = 0;
+			if (hid_match_report(hid, report))
+				report->dispatch |= HID_DISPATCH_RAW_EVENT;
+
+			for (i = 0; i < report->maxfield; i++) {
+				field = report->field[i];
+				for (j = 0; j < field->maxusage; j++) {
+					field->usage[j].dispatch = 0;
+					if (hid_match_usage(hid, &field->usage[j]))
+						field->usage[j].dispatch |=
+							HID_DISPATCH_EVENT;
+				}
+			}
+		}
+	}
+
+	/* flags must be visible before they are used */
+	smp_wmb();
+	hid->dispatch_cached = true;
+}
+
+static inline bool hid_dispatch_event(struct hid_device *hid,
+				      struct hid_usage *usage)
+{
+	if (hid->dispatch_cached)
+		return usage->dispatch & HID_DISPATCH_EVENT;
+	return hid_match_usage(hid, usage);
+}
+
+static inline bool hid_dispatch_raw_event(struct hid_device *hid,
+					  struct hid_report *report)
+{
+	if (hid->dispatch_cached)
+		return report->dispatch & HID_DISPATCH_RAW_EVENT;
+	return hid_match_report(hid, report);
+}
+
 static void hid_process_event(struct hid_device *hid, struct hid_field *field,
 		struct hid_usage *usage, __s32 value, int interrupt)
 {
@@ -1134,7 +1653,7 @@ static void hid_process_event(struct hid_device *hid, struct hid_field *field,
 	if (!list_empty(&hid->debug_list))
 		hid_dump_input(hid, usage, value);
 
-	if (hdrv && hdrv->event && hid_match_usage(hid, usage)) {
+	if (hdrv && hdrv->event && hid_dispatch_event(hid, usage)) {
 		ret = hdrv->event(hid, field, usage, value);
 		if (ret != 0) {
 			if (ret < 0)
@@ -1151,61 +1670,162 @@ static void hid_process_event(struct hid_device *hid, struct hid_field *field,
 }
 
 /*
- * Analyse a received field, and fetch the data from it. The field
- * content is stored for next report processing (we do differential
- * reporting to the layer).
+ * Fetch the values of a field from a report, following the decode plan
+ * computed by hid_setup_field_decode().
  */
 
-static void hid_input_field(struct hid_device *hid, struct hid_field *field,
-			    __u8 *data, int interrupt)
+static void hid_decode_field(const struct hid_device *hid,
+			     struct hid_field *field, __u8 *data, __s32 *value)
 {
 	unsigned n;
 	unsigned count = field->report_count;
 	unsigned offset = field->report_offset;
 	unsigned size = field->report_size;
+	__u8 *p = data + (offset >> 3);
+
+	switch (field->decode) {
+	case HID_DECODE_U8:
+		for (n = 0; n < count; n++)
+			value[n] = p[n];
+		break;
+	case HID_DECODE_S8:
+		for (n = 0; n < count; n++)
+			value[n] = (__s8)p[n];
+		break;
+	case HID_DECODE_U16:
+		for (n = 0; n < count; n++)
+			value[n] = get_unaligned_le16(p + 2 * n);
+		break;
+	case HID_DECODE_S16:
+		for (n = 0; n < count; n++)
+			value[n] = (__s16)get_unaligned_le16(p + 2 * n);
+		break;
+	case HID_DECODE_32:
+		for (n = 0; n < count; n++)
+			value[n] = get_unaligned_le32(p + 4 * n);
+		break;
+	case HID_DECODE_SIGNED:
+		for (n = 0; n < count; n++)
+			value[n] = snto32(extract(hid, data, offset + n * size,
+						  size), size);
+		break;
+	default:
+		for (n = 0; n < count; n++)
+			value[n] = extract(hid, data, offset + n * size, size);
+	}
+}
+
+/*
+ * Array fields carry the indexes of the active usages, offset by the
+ * logical minimum. Only values pointing inside the usage table are
+ * meaningful.
+ */
+
+static inline bool hid_array_value_valid(struct hid_field *field, __s32 value)
+{
+	return value >= field->logical_minimum &&
+		value <= field->logical_maximum &&
+		(__u32)value - (__u32)field->logical_minimum < field->maxusage;
+}
+
+/*
+ * Emit the released and pressed usages of an array field. The previous
+ * and the new set of usages are first turned into bitmaps, so that the
+ * difference is computed in O(report_count) instead of searching each
+ * value in the other array.
+ */
+
+static void hid_input_array_field(struct hid_device *hid,
+				  struct hid_field *field, int interrupt)
+{
+	unsigned n;
+	unsigned count = field->report_count;
 	__s32 min = field->logical_minimum;
-	__s32 max = field->logical_maximum;
-	__s32 *value;
+	__s32 *old_value = field->value;
+	__s32 *value = field->new_value;
+	unsigned long *old_bits = field->usage_bits;
+	unsigned long *new_bits = field->new_usage_bits;
 
-	value = kmalloc(sizeof(__s32) * count, GFP_ATOMIC);
-	if (!value)
-		return;
+	bitmap_zero(old_bits, field->maxusage);
+	bitmap_zero(new_bits, field->maxusage);
 
 	for (n = 0; n < count; n++) {
+		if (hid_array_value_valid(field, old_value[n]))
+			__set_bit(old_value[n] - min, old_bits);
+		if (hid_array_value_valid(field, value[n]))
+			__set_bit(value[n] - min, new_bits);
+	}
 
-		value[n] = min < 0 ?
-			snto32(extract(hid, data, offset + n * size, size),
-			       size) :
-			extract(hid, data, offset + n * size, size);
+	for (n = 0; n < count; n++) {
 
-		/* Ignore report if ErrorRollOver */
-		if (!(field->flags & HID_MAIN_ITEM_VARIABLE) &&
-		    value[n] >= min && value[n] <= max &&
-		    field->usage[value[n] - min].hid == HID_UP_KEYBOARD + 1)
-			goto exit;
+		if (hid_array_value_valid(field, old_value[n])
+			&& field->usage[old_value[n] - min].hid
+			&& !test_bit(old_value[n] - min, new_bits))
+				hid_process_event(hid, field, &field->usage[old_value[n] - min], 0, interrupt);
+
+		if (hid_array_value_valid(field, value[n])
+			&& field->usage[value[n] - min].hid
+			&& !test_bit(value[n] - min, old_bits))
+				hid_process_event(hid, field, &field->usage[value[n] - min], 1, interrupt);
 	}
+}
 
-	for (n = 0; n < count; n++) {
+/*
+ * Analyse a received field, and fetch the data from it. The field
+ * content is stored for next report processing (we do differential
+ * reporting to the layer).
+ *
+ * The incoming values are decoded into field->new_value, which has been
+ * allocated along with the field, so that no allocation is needed in
+ * interrupt context.
+ */
 
-		if (HID_MAIN_ITEM_VARIABLE & field->flags) {
+static void hid_input_field(struct hid_device *hid, struct hid_field *field,
+			    __u8 *data, int interrupt)
+{
+	unsigned n;
+	unsigned count = field->report_count;
+	__s32 min = field->logical_minimum;
+	__s32 *value = field->new_value;
+
+	hid_decode_field(hid, field, data, value);
+
+	if (HID_MAIN_ITEM_VARIABLE & field->flags) {
+		for (n = 0; n < count; n++)
 			hid_process_event(hid, field, &field->usage[n], value[n], interrupt);
-			continue;
+	} else {
+		/* Ignore report if ErrorRollOver */
+		for (n = 0; n < count; n++) {
+			if (hid_array_value_valid(field, value[n]) &&
+			    field->usage[value[n] - min].hid == HID_UP_KEYBOARD + 1)
+				return;
 		}
 
-		if (field->value[n] >= min && field->value[n] <= max
-			&& field->usage[field->value[n] - min].hid
-			&& search(value, field->value[n], count))
-				hid_process_event(hid, field, &field->usage[field->value[n] - min], 0, interrupt);
-
-		if (value[n] >= min && value[n] <= max
-			&& field->usage[value[n] - min].hid
-			&& search(field->value, value[n], count))
-				hid_process_event(hid, field, &field->usage[value[n] - min], 1, interrupt);
+		hid_input_array_field(hid, field, interrupt);
 	}
 
 	memcpy(field->value, value, count * sizeof(__s32));
-exit:
-	kfree(value);
+}
+
+/*
+ * Show the decoded values of a field in the debugfs events file, for
+ * reports whose per-usage processing is skipped (HID_REPORT_MODE_RAW).
+ * Array fields list the usages currently set.
+ */
+
+static void hid_dump_field(struct hid_device *hid, struct hid_field *field)
+{
+	unsigned n;
+	__s32 min = field->logical_minimum;
+	__s32 *value = field->value;
+
+	for (n = 0; n < field->report_count; n++) {
+		if (HID_MAIN_ITEM_VARIABLE & field->flags)
+			hid_dump_input(hid, &field->usage[n], value[n]);
+		else if (hid_array_value_valid(field, value[n]) &&
+			 field->usage[value[n] - min].hid)
+			hid_dump_input(hid, &field->usage[value[n] - min], 1);
+	}
 }
 
 /*
@@ -1354,9 +1974,21 @@ int hid_report_raw_event(struct hid_device *hid, int type, u8 *data, int size,
 	}
 
 	if (hid->claimed != HID_CLAIMED_HIDRAW && report->maxfield) {
-		for (a = 0; a < report->maxfield; a++)
-			hid_input_field(hid, report->field[a], cdata, interrupt);
 		hdrv = hid->driver;
+		if (report->mode != HID_REPORT_MODE_RAW) {
+			for (a = 0; a < report->maxfield; a++)
+				hid_input_field(hid, report->field[a], cdata,
+						interrupt);
+		} else if ((hdrv && hdrv->report) ||
+			   !list_empty(&hid->debug_list)) {
+			/* the driver owns the report, only refresh values */
+			for (a = 0; a < report->maxfield; a++) {
+				hid_decode_field(hid, report->field[a], cdata,
+						 report->field[a]->value);
+				if (!list_empty(&hid->debug_list))
+					hid_dump_field(hid, report->field[a]);
+			}
+		}
 		if (hdrv && hdrv->report)
 			hdrv->report(hid, report);
 	}
@@ -1368,41 +2000,25 @@ out:
 }
 EXPORT_SYMBOL_GPL(hid_report_raw_event);
 
-/**
- * hid_input_report - report data from lower layer (usb, bt...)
- *
- * @hid: hid device
- * @type: HID report type (HID_*_REPORT)
- * @data: report contents
- * @size: size of data parameter
- * @interrupt: distinguish between interrupt and control transfers
- *
- * This is data entry for lower layers.
- */
-int hid_input_report(struct hid_device *hid, int type, u8 *data, int size, int interrupt)
+/* process one input report, with driver_input_lock held */
+static int __hid_input_report(struct hid_device *hid, int type, u8 *data,
+			      int size, int interrupt, u64 timestamp)
 {
 	struct hid_report_enum *report_enum;
 	struct hid_driver *hdrv;
 	struct hid_report *report;
-	int ret = 0;
-
-	if (!hid)
-		return -ENODEV;
+	int ret;
 
-	if (down_trylock(&hid->driver_input_lock))
-		return -EBUSY;
+	hid->input_timestamp = timestamp;
 
-	if (!hid->driver) {
-		ret = -ENODEV;
-		goto unlock;
-	}
+	if (!hid->driver)
+		return -ENODEV;
 	report_enum = hid->report_enum + type;
 	hdrv = hid->driver;
 
 	if (!size) {
 		dbg_hid("empty report\n");
-		ret = -1;
-		goto unlock;
+		return -1;
 	}
 
 	/* Avoid unnecessary overhead if debugfs is disabled */
@@ -1411,23 +2027,180 @@ int hid_input_report(struct hid_device *hid, int type, u8 *data, int size, int i
 
 	report = hid_get_report(report_enum, data);
 
-	if (!report) {
-		ret = -1;
-		goto unlock;
-	}
+	if (!report)
+		return -1;
 
-	if (hdrv && hdrv->raw_event && hid_match_report(hid, report)) {
+	if (hdrv && hdrv->raw_event && report->mode != HID_REPORT_MODE_FIELDS &&
+	    hid_dispatch_raw_event(hid, report)) {
 		ret = hdrv->raw_event(hid, report, data, size);
 		if (ret < 0)
+			return ret;
+	}
+
+	return hid_report_raw_event(hid, type, data, size, interrupt);
+}
+
+/*
+ * Keep a report that arrived while driver_input_lock was held, so that it is
+ * processed once the lock is released instead of being lost.
+ */
+static int hid_stage_report(struct hid_device *hid, int type, u8 *data,
+			    int size, int interrupt, u64 timestamp)
+{
+	struct hid_staged_report *staged;
+	unsigned long flags;
+	unsigned head;
+	u8 *buf;
+	int ret = 0;
+
+	spin_lock_irqsave(&hid->staging_lock, flags);
+
+	head = (hid->staging_head + 1) % HID_STAGING_SLOTS;
+	if (head == hid->staging_tail) {
+		hid->dropped_reports++;
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	staged = &hid->staging[hid->staging_head];
+	if (hid->staging_pool && size <= hid->staging_stride) {
+		buf = hid->staging_pool + hid->staging_head * hid->staging_stride;
+		staged->allocated = false;
+	} else {
+		/* not parsed yet, or longer than any input report */
+		buf = kmalloc(size + 7, GFP_ATOMIC);
+		if (!buf) {
+			hid->dropped_reports++;
+			ret = -ENOMEM;
 			goto unlock;
+		}
+		staged->allocated = true;
 	}
 
-	ret = hid_report_raw_event(hid, type, data, size, interrupt);
+	staged->timestamp = timestamp;
+	staged->type = type;
+	staged->size = size;
+	staged->interrupt = interrupt;
+	staged->data = buf;
+	memcpy(buf, data, size);
+
+	hid->staging_head = head;
+	hid->staged_reports++;
 
 unlock:
+	spin_unlock_irqrestore(&hid->staging_lock, flags);
+
+	if (!ret)
+		schedule_work(&hid->staging_work);
+	return ret;
+}
+
+/*
+ * Process the staged reports in order, with driver_input_lock held. Only the
+ * lock holder consumes slots, so producers do not reuse a slot until
+ * staging_tail has moved past it.
+ *
+ * A slot only has room for the data that was received, while the report may
+ * be padded up to its declared size. It is processed from the bounce buffer,
+ * or in place when it is too long for it (then the buffer is its own, with
+ * the slack extract() needs, and it is not short).
+ */
+static void hid_drain_staged_reports(struct hid_device *hid)
+{
+	struct hid_staged_report *staged;
+	unsigned long flags;
+	u8 *data;
+
+	spin_lock_irqsave(&hid->staging_lock, flags);
+	while (hid->staging_tail != hid->staging_head) {
+		staged = &hid->staging[hid->staging_tail];
+		spin_unlock_irqrestore(&hid->staging_lock, flags);
+
+		data = staged->data;
+		if (staged->size <= HID_STAGING_BOUNCE_SIZE - 7) {
+			memcpy(hid->staging_bounce, data, staged->size);
+			data = hid->staging_bounce;
+		}
+		__hid_input_report(hid, staged->type, data,
+				   staged->size, staged->interrupt,
+				   staged->timestamp);
+		if (staged->allocated)
+			kfree(staged->data);
+
+		spin_lock_irqsave(&hid->staging_lock, flags);
+		hid->staging_tail = (hid->staging_tail + 1) % HID_STAGING_SLOTS;
+	}
+	spin_unlock_irqrestore(&hid->staging_lock, flags);
+}
+
+static void hid_staging_work(struct work_struct *work)
+{
+	struct hid_device *hid = container_of(work, struct hid_device,
+					      staging_work);
+
+	down(&hid->driver_input_lock);
+	hid_drain_staged_reports(hid);
+	up(&hid->driver_input_lock);
+}
+
+/**
+ * hid_input_report_timestamp - report data received at a given time
+ *
+ * @hid: hid device
+ * @type: HID report type (HID_*_REPORT)
+ * @data: report contents
+ * @size: size of data parameter
+ * @interrupt: distinguish between interrupt and control transfers
+ * @timestamp: arrival time of the report, CLOCK_MONOTONIC in ns
+ *
+ * Same as hid_input_report(), for lower layers that process reports some
+ * time after they arrived. @timestamp is kept in hid->input_timestamp while
+ * the report is processed.
+ */
+int hid_input_report_timestamp(struct hid_device *hid, int type, u8 *data,
+			       int size, int interrupt, u64 timestamp)
+{
+	int ret;
+
+	if (!hid)
+		return -ENODEV;
+
+	if (down_trylock(&hid->driver_input_lock))
+		return hid_stage_report(hid, type, data, size, interrupt,
+					timestamp);
+
+	/* older reports first */
+	hid_drain_staged_reports(hid);
+
+	ret = __hid_input_report(hid, type, data, size, interrupt, timestamp);
+
 	up(&hid->driver_input_lock);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(hid_input_report_timestamp);
+
+/**
+ * hid_input_report - report data from lower layer (usb, bt...)
+ *
+ * @hid: hid device
+ * @type: HID report type (HID_*_REPORT)
+ * @data: report contents
+ * @size: size of data parameter
+ * @interrupt: distinguish between interrupt and control transfers
+ *
+ * This is data entry for lower layers. The arrival time of the report is
+ * kept in hid->input_timestamp while it is processed.
+ *
+ * If the driver is busy (being bound, or in a slow raw_event()), the report
+ * is staged and processed later, in order, and 0 is returned. -EBUSY is
+ * returned when staging is full, -ENOMEM when the report could not be
+ * copied.
+ */
+int hid_input_report(struct hid_device *hid, int type, u8 *data, int size, int interrupt)
+{
+	return hid_input_report_timestamp(hid, type, data, size, interrupt,
+					  ktime_to_ns(ktime_get()));
+}
 EXPORT_SYMBOL_GPL(hid_input_report);
 
 static bool hid_match_one_id(struct hid_device *hdev,
@@ -1449,6 +2222,153 @@ const struct hid_device_id *hid_match_id(struct hid_device *hdev,
 	return NULL;
 }
 
+/*
+ * Index of a device id table, so that matching a device does not scan the
+ * whole table. Entries with a fixed bus, vendor and product are sorted by
+ * that key; the others (wildcards) are kept apart, in table order. The
+ * result is the same as hid_match_id(): the first matching entry of the
+ * table.
+ */
+
+struct hid_id_key {
+	__u32 vendor;
+	__u32 product;
+	__u16 bus;
+	unsigned index;		/* position in the table */
+};
+
+struct hid_id_index {
+	struct hid_id_key *exact;
+	unsigned nexact;
+	unsigned *wild;
+	unsigned nwild;
+};
+
+static int hid_id_key_cmp(const void *a, const void *b)
+{
+	const struct hid_id_key *ka = a, *kb = b;
+
+	if (ka->bus != kb->bus)
+		return ka->bus < kb->bus ? -1 : 1;
+	if (ka->vendor != kb->vendor)
+		return ka->vendor < kb->vendor ? -1 : 1;
+	if (ka->product != kb->product)
+		return ka->product < kb->product ? -1 : 1;
+	if (ka->index != kb->index)
+		return ka->index < kb->index ? -1 : 1;
+	return 0;
+}
+
+static bool hid_id_is_wild(const struct hid_device_id *id)
+{
+	return id->bus == HID_BUS_ANY || id->vendor == HID_ANY_ID ||
+		id->product == HID_ANY_ID;
+}
+
+static void hid_free_id_index(struct hid_id_index *idx)
+{
+	if (!idx)
+		return;
+	kfree(idx->exact);
+	kfree(idx->wild);
+	kfree(idx);
+}
+
+/* returns NULL on failure; the table is then scanned linearly */
+static struct hid_id_index *hid_build_id_index(const struct hid_device_id *table)
+{
+	struct hid_id_index *idx;
+	struct hid_id_key *key;
+	unsigned i, n, nwild = 0;
+
+	if (!table)
+		return NULL;
+
+	for (n = 0; table[n].bus; n++)
+		if (hid_id_is_wild(&table[n]))
+			nwild++;
+
+	idx = kzalloc(sizeof(*idx), GFP_KERNEL);
+	if (!idx)
+		return NULL;
+
+	idx->exact = kcalloc(n - nwild ? : 1, sizeof(*idx->exact), GFP_KERNEL);
+	idx->wild = kcalloc(nwild ? : 1, sizeof(*idx->wild), GFP_KERNEL);
+	if (!idx->exact || !idx->wild) {
+		hid_free_id_index(idx);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (hid_id_is_wild(&table[i])) {
+			idx->wild[idx->nwild++] = i;
+			continue;
+		}
+		key = &idx->exact[idx->nexact++];
+		key->bus = table[i].bus;
+		key->vendor = table[i].vendor;
+		key->product = table[i].product;
+		key->index = i;
+	}
+
+	sort(idx->exact, idx->nexact, sizeof(*idx->exact), hid_id_key_cmp,
+	     NULL);
+
+	return idx;
+}
+
+static const struct hid_device_id *hid_match_id_index(struct hid_device *hdev,
+		const struct hid_id_index *idx, const struct hid_device_id *table)
+{
+	struct hid_id_key key = {
+		.bus = hdev->bus,
+		.vendor = hdev->vendor,
+		.product = hdev->product,
+		.index = 0,
+	};
+	unsigned lo = 0, hi, mid, i;
+	unsigned best = UINT_MAX;
+
+	if (!idx)
+		return table ? hid_match_id(hdev, table) : NULL;
+
+	/* first exact entry for this bus/vendor/product */
+	hi = idx->nexact;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (hid_id_key_cmp(&idx->exact[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < idx->nexact; lo++) {
+		i = idx->exact[lo].index;
+		if (idx->exact[lo].bus != key.bus ||
+		    idx->exact[lo].vendor != key.vendor ||
+		    idx->exact[lo].product != key.product)
+			break;
+		if (hid_match_one_id(hdev, &table[i])) {
+			best = i;
+			break;
+		}
+	}
+
+	/* a wildcard entry placed earlier in the table wins */
+	for (i = 0; i < idx->nwild && idx->wild[i] < best; i++) {
+		if (hid_match_one_id(hdev, &table[idx->wild[i]])) {
+			best = idx->wild[i];
+			break;
+		}
+	}
+
+	return best == UINT_MAX ? NULL : &table[best];
+}
+
+static struct hid_id_index *hid_special_index;
+static struct hid_id_index *hid_ignore_index;
+static struct hid_id_index *hid_mouse_ignore_index;
+
 static const struct hid_device_id hid_hiddev_list[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MGE, USB_DEVICE_ID_MGE_UPS) },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MGE, USB_DEVICE_ID_MGE_UPS1) },
@@ -1529,6 +2449,9 @@ int hid_connect(struct hid_device *hdev, unsigned int connect_mask)
 			(connect_mask & HID_CONNECT_FF) && hdev->ff_init)
 		hdev->ff_init(hdev);
 
+	/* usage types and codes are final once the inputs are connected */
+	hid_setup_dispatch(hdev);
+
 	len = 0;
 	if (hdev->claimed & HID_CLAIMED_INPUT)
 		len += sprintf(buf + len, "input");
@@ -1576,6 +2499,7 @@ EXPORT_SYMBOL_GPL(hid_connect);
 
 void hid_disconnect(struct hid_device *hdev)
 {
+	hdev->dispatch_cached = false;
 	device_remove_bin_file(&hdev->dev, &dev_bin_attr_report_desc);
 	if (hdev->claimed & HID_CLAIMED_INPUT)
 		hidinput_disconnect(hdev);
@@ -1883,9 +2807,16 @@ static const struct hid_device_id hid_have_special_driver[] = {
 
 struct hid_dynid {
 	struct list_head list;
+	struct list_head hash_node;	/* in hid_driver->dyn_hash or dyn_wild */
+	unsigned long seq;		/* order of addition, see hid_match_device() */
 	struct hid_device_id id;
 };
 
+static unsigned hid_dynid_hash(__u16 bus, __u32 vendor, __u32 product)
+{
+	return hash_32(bus ^ (vendor << 16) ^ product, HID_DYNID_HASH_BITS);
+}
+
 /**
  * store_new_id - add a new HID device ID to this driver and re-probe devices
  * @driver: target device driver
@@ -1920,7 +2851,15 @@ static ssize_t store_new_id(struct device_driver *drv, const char *buf,
 	dynid->id.driver_data = driver_data;
 
 	spin_lock(&hdrv->dyn_lock);
+	dynid->seq = hdrv->dyn_seq++;
 	list_add_tail(&dynid->list, &hdrv->dyn_list);
+	if (hid_id_is_wild(&dynid->id))
+		list_add_tail(&dynid->hash_node, &hdrv->dyn_wild);
+	else
+		list_add_tail(&dynid->hash_node,
+			      &hdrv->dyn_hash[hid_dynid_hash(dynid->id.bus,
+							     dynid->id.vendor,
+							     dynid->id.product)]);
 	spin_unlock(&hdrv->dyn_lock);
 
 	ret = driver_attach(&hdrv->driver);
@@ -1936,6 +2875,7 @@ static void hid_free_dynids(struct hid_driver *hdrv)
 	spin_lock(&hdrv->dyn_lock);
 	list_for_each_entry_safe(dynid, n, &hdrv->dyn_list, list) {
 		list_del(&dynid->list);
+		list_del(&dynid->hash_node);
 		kfree(dynid);
 	}
 	spin_unlock(&hdrv->dyn_lock);
@@ -1944,18 +2884,35 @@ static void hid_free_dynids(struct hid_driver *hdrv)
 static const struct hid_device_id *hid_match_device(struct hid_device *hdev,
 		struct hid_driver *hdrv)
 {
-	struct hid_dynid *dynid;
+	struct hid_dynid *dynid, *exact = NULL, *wild = NULL;
+	struct list_head *bucket;
+
+	bucket = &hdrv->dyn_hash[hid_dynid_hash(hdev->bus, hdev->vendor,
+						hdev->product)];
 
 	spin_lock(&hdrv->dyn_lock);
-	list_for_each_entry(dynid, &hdrv->dyn_list, list) {
+	list_for_each_entry(dynid, bucket, hash_node) {
+		if (hid_match_one_id(hdev, &dynid->id)) {
+			exact = dynid;
+			break;
+		}
+	}
+	/* new_id accepts HID_BUS_ANY and HID_ANY_ID too */
+	list_for_each_entry(dynid, &hdrv->dyn_wild, hash_node) {
 		if (hid_match_one_id(hdev, &dynid->id)) {
-			spin_unlock(&hdrv->dyn_lock);
-			return &dynid->id;
+			wild = dynid;
+			break;
 		}
 	}
+	/* the id added first wins, as with a walk of dyn_list */
+	if (!exact || (wild && wild->seq < exact->seq))
+		exact = wild;
 	spin_unlock(&hdrv->dyn_lock);
 
-	return hid_match_id(hdev, hdrv->id_table);
+	if (exact)
+		return &exact->id;
+
+	return hid_match_id_index(hdev, hdrv->id_index, hdrv->id_table);
 }
 
 static int hid_bus_match(struct device *dev, struct device_driver *drv)
@@ -2402,10 +3359,11 @@ bool hid_ignore(struct hid_device *hdev)
 	}
 
 	if (hdev->type == HID_TYPE_USBMOUSE &&
-			hid_match_id(hdev, hid_mouse_ignore_list))
+			hid_match_id_index(hdev, hid_mouse_ignore_index,
+					   hid_mouse_ignore_list))
 		return true;
 
-	return !!hid_match_id(hdev, hid_ignore_list);
+	return !!hid_match_id_index(hdev, hid_ignore_index, hid_ignore_list);
 }
 EXPORT_SYMBOL_GPL(hid_ignore);
 
@@ -2436,7 +3394,8 @@ int hid_add_device(struct hid_device *hdev)
 	 * Scan generic devices for group information
 	 */
 	if (hid_ignore_special_drivers ||
-	    !hid_match_id(hdev, hid_have_special_driver)) {
+	    !hid_match_id_index(hdev, hid_special_index,
+				hid_have_special_driver)) {
 		ret = hid_scan_report(hdev);
 		if (ret)
 			hid_warn(hdev, "bad device descriptor (%d)\n", ret);
@@ -2476,6 +3435,16 @@ struct hid_device *hid_allocate_device(void)
 	if (hdev == NULL)
 		return ERR_PTR(ret);
 
+	hdev->staging = kcalloc(HID_STAGING_SLOTS, sizeof(*hdev->staging),
+				GFP_KERNEL);
+	hdev->staging_bounce = kmalloc(HID_STAGING_BOUNCE_SIZE, GFP_KERNEL);
+	if (hdev->staging == NULL || hdev->staging_bounce == NULL) {
+		kfree(hdev->staging);
+		kfree(hdev->staging_bounce);
+		kfree(hdev);
+		return ERR_PTR(ret);
+	}
+
 	device_initialize(&hdev->dev);
 	hdev->dev.release = hid_device_release;
 	hdev->dev.bus = &hid_bus_type;
@@ -2487,6 +3456,8 @@ struct hid_device *hid_allocate_device(void)
 	spin_lock_init(&hdev->debug_list_lock);
 	sema_init(&hdev->driver_lock, 1);
 	sema_init(&hdev->driver_input_lock, 1);
+	spin_lock_init(&hdev->staging_lock);
+	INIT_WORK(&hdev->staging_work, hid_staging_work);
 
 	return hdev;
 }
@@ -2515,6 +3486,7 @@ static void hid_remove_device(struct hid_device *hdev)
 void hid_destroy_device(struct hid_device *hdev)
 {
 	hid_remove_device(hdev);
+	cancel_work_sync(&hdev->staging_work);
 	put_device(&hdev->dev);
 }
 EXPORT_SYMBOL_GPL(hid_destroy_device);
@@ -2522,6 +3494,7 @@ EXPORT_SYMBOL_GPL(hid_destroy_device);
 int __hid_register_driver(struct hid_driver *hdrv, struct module *owner,
 		const char *mod_name)
 {
+	unsigned i;
 	int ret;
 
 	hdrv->driver.name = hdrv->name;
@@ -2531,15 +3504,27 @@ int __hid_register_driver(struct hid_driver *hdrv, struct module *owner,
 
 	INIT_LIST_HEAD(&hdrv->dyn_list);
 	spin_lock_init(&hdrv->dyn_lock);
+	for (i = 0; i < ARRAY_SIZE(hdrv->dyn_hash); i++)
+		INIT_LIST_HEAD(&hdrv->dyn_hash[i]);
+	INIT_LIST_HEAD(&hdrv->dyn_wild);
+
+	/* needed as soon as the driver is registered, for bus matching */
+	hdrv->id_index = hid_build_id_index(hdrv->id_table);
 
 	ret = driver_register(&hdrv->driver);
 	if (ret)
-		return ret;
+		goto err;
 
 	ret = driver_create_file(&hdrv->driver, &driver_attr_new_id);
-	if (ret)
+	if (ret) {
 		driver_unregister(&hdrv->driver);
+		goto err;
+	}
 
+	return 0;
+err:
+	hid_free_id_index(hdrv->id_index);
+	hdrv->id_index = NULL;
 	return ret;
 }
 EXPORT_SYMBOL_GPL(__hid_register_driver);
@@ -2549,21 +3534,52 @@ void hid_unregister_driver(struct hid_driver *hdrv)
 	driver_remove_file(&hdrv->driver, &driver_attr_new_id);
 	driver_unregister(&hdrv->driver);
 	hid_free_dynids(hdrv);
+	hid_free_id_index(hdrv->id_index);
+	hdrv->id_index = NULL;
 }
 EXPORT_SYMBOL_GPL(hid_unregister_driver);
 
+/*
+ * input_event() counts the keys pressed on each input device, so the
+ * common case (nothing pressed) does not need to scan the key bitmaps.
+ * The input core may still release keys behind our back (e.g. when the
+ * device is closed), so a non-zero count is checked against the bitmap
+ * and fixed up if it is stale.
+ */
+static bool hid_input_keys_pressed(struct input_dev *input)
+{
+	struct __compat_input_dev *c_dev = __input_to_compat(input);
+	unsigned long flags;
+	bool pressed = false;
+	int i;
+
+	if (!ACCESS_ONCE(c_dev->keys_pressed))
+		return false;
+
+	spin_lock_irqsave(&input->event_lock, flags);
+	for (i = 0; i < BITS_TO_LONGS(KEY_MAX); i++) {
+		if (input->key[i]) {
+			pressed = true;
+			break;
+		}
+	}
+	if (!pressed)
+		c_dev->keys_pressed = 0;
+	spin_unlock_irqrestore(&input->event_lock, flags);
+
+	return pressed;
+}
+
 int hid_check_keys_pressed(struct hid_device *hid)
 {
 	struct hid_input *hidinput;
-	int i;
 
 	if (!(hid->claimed & HID_CLAIMED_INPUT))
 		return 0;
 
 	list_for_each_entry(hidinput, &hid->inputs, list) {
-		for (i = 0; i < BITS_TO_LONGS(KEY_MAX); i++)
-			if (hidinput->input->key[i])
-				return 1;
+		if (hid_input_keys_pressed(hidinput->input))
+			return 1;
 	}
 
 	return 0;
@@ -2571,6 +3587,16 @@ int hid_check_keys_pressed(struct hid_device *hid)
 
 EXPORT_SYMBOL_GPL(hid_check_keys_pressed);
 
+static void hid_free_id_indexes(void)
+{
+	hid_free_id_index(hid_special_index);
+	hid_free_id_index(hid_ignore_index);
+	hid_free_id_index(hid_mouse_ignore_index);
+	hid_special_index = NULL;
+	hid_ignore_index = NULL;
+	hid_mouse_ignore_index = NULL;
+}
+
 static int __init hid_init(void)
 {
 	int ret;
@@ -2579,6 +3605,11 @@ static int __init hid_init(void)
 		pr_warn("hid_debug is now used solely for parser and driver debugging.\n"
 			"debugfs is now used for inspecting the device (report descriptor, reports)\n");
 
+	/* on failure, the lists are scanned linearly */
+	hid_special_index = hid_build_id_index(hid_have_special_driver);
+	hid_ignore_index = hid_build_id_index(hid_ignore_list);
+	hid_mouse_ignore_index = hid_build_id_index(hid_mouse_ignore_list);
+
 	ret = bus_register(&hid_bus_type);
 	if (ret) {
 		pr_err("can't register hid bus\n");
@@ -2595,6 +3626,7 @@ static int __init hid_init(void)
 err_bus:
 	bus_unregister(&hid_bus_type);
 err:
+	hid_free_id_indexes();
 	return ret;
 }
 
@@ -2603,6 +3635,8 @@ static void __exit hid_exit(void)
 	hid_debug_exit();
 	hidraw_exit();
 	bus_unregister(&hid_bus_type);
+	hid_flush_desc_cache();
+	hid_free_id_indexes();
 }
 
 module_init(hid_init);
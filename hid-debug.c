@@ -947,6 +947,37 @@ static void hid_dump_input_mapping(struct hid_device *hid, struct seq_file *f)
 
 }
 
+/*
+ * Memory used by the parsed reports, compared with what the field arrays
+ * would cost if each report still embedded HID_MAX_FIELDS pointers.
+ */
+static void hid_dump_footprint(struct hid_device *hdev, struct seq_file *f)
+{
+	struct hid_report *report;
+	size_t reports = 0, arrays = 0, fixed = 0, fields = 0;
+	unsigned i, j, count = 0;
+
+	for (i = 0; i < HID_REPORT_TYPES; i++) {
+		list_for_each_entry(report,
+				    &hdev->report_enum[i].report_list, list) {
+			count++;
+			reports += ksize(report);
+			if (report->field)
+				arrays += ksize(report->field);
+			fixed += HID_MAX_FIELDS * sizeof(*report->field);
+			for (j = 0; j < report->maxfield; j++)
+				fields += ksize(report->field[j]);
+		}
+	}
+
+	seq_printf(f, "\nreports: %u, %zu bytes\n", count, reports);
+	seq_printf(f, "field arrays: %zu bytes (%zu if fixed size)\n",
+		   arrays, fixed);
+	seq_printf(f, "fields: %zu bytes\n", fields);
+	seq_printf(f, "total: %zu bytes (%zu if fixed size)\n",
+		   reports + arrays + fields, reports + fixed + fields);
+}
+
 static int hid_debug_rdesc_show(struct seq_file *f, void *p)
 {
 	struct hid_device *hdev = f->private;
@@ -969,6 +1000,12 @@ static int hid_debug_rdesc_show(struct seq_file *f, void *p)
 	seq_printf(f, "\n");
 	hid_dump_input_mapping(hdev, f);
 
+	/* reports received while the driver was busy */
+	seq_printf(f, "\nstaged reports: %lu\ndropped reports: %lu\n",
+		   hdev->staged_reports, hdev->dropped_reports);
+
+	hid_dump_footprint(hdev, f);
+
 	return 0;
 }
 
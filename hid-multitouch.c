@@ -45,6 +45,7 @@
 #include <linux/usb.h>
 #include <linux/input/mt.h>
 #include <linux/string.h>
+#include <linux/log2.h>
 
 /* forward multitouch option */
 static bool show_mt = true;
@@ -121,6 +122,8 @@ struct mt_device {
 	unsigned mt_flags;	/* flags to pass to input-mt */
 	int mouse_emulation_slot; /* used if show_mt is false */
 	int * mouse_emulation_slot_states; /* used if show_mt is false */
+	int *slot_cache;	/* direct-mapped ContactID -> slot cache */
+	unsigned slot_cache_mask;	/* size of slot_cache - 1 */
 };
 
 static void mt_post_parse_default_settings(struct mt_device *td);
@@ -559,6 +562,76 @@ static int mt_touch_input_mapped(struct hid_device *hdev, struct hid_input *hi,
 	return -1;
 }
 
+/*
+ * The slot of a contact is looked up for each contact of each report. Keep
+ * the last slot assigned to a ContactID in a small direct-mapped cache, so
+ * that the slots only need to be scanned when a new contact appears or on
+ * a cache collision. Entries are validated against the slot state before
+ * being used, so a stale entry only costs a regular lookup.
+ */
+static int mt_slot_cache_get(struct mt_device *td, __s32 contactid)
+{
+	if (!td->slot_cache)
+		return -1;
+
+	return td->slot_cache[contactid & td->slot_cache_mask];
+}
+
+static void mt_slot_cache_set(struct mt_device *td, __s32 contactid, int slot)
+{
+	if (td->slot_cache)
+		td->slot_cache[contactid & td->slot_cache_mask] = slot;
+}
+
+static int mt_compute_emulated_slot(struct mt_device *td)
+{
+	__s32 contactid = td->curdata.contactid;
+	int i;
+	int slot = mt_slot_cache_get(td, contactid);
+
+	if (slot >= 0 &&
+	    td->mouse_emulation_slot_states[slot] == contactid)
+		return slot;
+
+	slot = -1;
+
+	for (i = 0; i < td->maxcontacts && slot < 0; i++)
+	{
+		if (td-> mouse_emulation_slot_states[i] == contactid)
+			slot = i;
+	}
+
+	for (i = 0; i < td->maxcontacts && slot < 0; i++)
+	{
+		if (td-> mouse_emulation_slot_states[i] < 0)
+			slot = i;
+	}
+
+	if (slot >= 0)
+		mt_slot_cache_set(td, contactid, slot);
+
+	return slot;
+}
+
+static int mt_compute_slot_by_key(struct mt_device *td,
+		struct input_dev *input)
+{
+	struct input_mt *mt = input_get_mt(input); /** compat */
+	__s32 contactid = td->curdata.contactid;
+	int slot = mt_slot_cache_get(td, contactid);
+
+	if (mt && slot >= 0 && slot < mt->num_slots &&
+	    input_mt_is_active(&mt->slots[slot]) &&
+	    mt->slots[slot].key == contactid)
+		return slot;
+
+	slot = input_mt_get_slot_by_key(input, contactid);
+	if (slot >= 0)
+		mt_slot_cache_set(td, contactid, slot);
+
+	return slot;
+}
+
 static int mt_compute_slot(struct mt_device *td, struct input_dev *input)
 {
 	__s32 quirks = td->mtclass.quirks;
@@ -577,26 +650,12 @@ static int mt_compute_slot(struct mt_device *td, struct input_dev *input)
 
 	if (!show_mt) {
 		/* manually compute slot */
-		int i;
-		int slot = -1;
-
 		if (!td-> mouse_emulation_slot_states)
 			return 0;
 
-		for (i = 0; i < td->maxcontacts && slot < 0; i++)
-		{
-			if (td-> mouse_emulation_slot_states[i] == td->curdata.contactid)
-				slot = i;
-		}
-
-		for (i = 0; i < td->maxcontacts && slot < 0; i++)
-		{
-			if (td-> mouse_emulation_slot_states[i] < 0)
-				slot = i;
-		}
-		return slot;
+		return mt_compute_emulated_slot(td);
 	}
-	return input_mt_get_slot_by_key(input, td->curdata.contactid);
+	return mt_compute_slot_by_key(td, input);
 }
 
 /*
@@ -641,10 +700,12 @@ static void mt_complete_slot(struct mt_device *td, struct input_dev *input)
 			}
 
 			if (td-> mouse_emulation_slot_states) {
-				if (s->touch_state || s->inrange_state)
+				if (s->touch_state || s->inrange_state) {
 					td-> mouse_emulation_slot_states[slotnum] = s->contactid;
-				else
+				} else {
 					td-> mouse_emulation_slot_states[slotnum] = -1;
+					mt_slot_cache_set(td, s->contactid, -1);
+				}
 			}
 		}
 
@@ -779,6 +840,7 @@ static void mt_process_mt_event(struct hid_device *hid, struct hid_field *field,
 static void mt_touch_report(struct hid_device *hid, struct hid_report *report)
 {
 	struct mt_device *td = hid_get_drvdata(hid);
+	struct input_dev *input = report->field[0]->hidinput->input;
 	struct hid_field *field;
 	unsigned count;
 	int r, n;
@@ -794,6 +856,9 @@ static void mt_touch_report(struct hid_device *hid, struct hid_report *report)
 			td->num_expected = value;
 	}
 
+	/* queue the whole frame under a single event_lock round-trip */
+	input_event_batch_begin(input);
+
 	for (r = 0; r < report->maxfield; r++) {
 		field = report->field[r];
 		count = field->report_count;
@@ -807,7 +872,9 @@ static void mt_touch_report(struct hid_device *hid, struct hid_report *report)
 	}
 
 	if (td->num_received >= td->num_expected)
-		mt_sync_frame(td, report->field[0]->hidinput->input);
+		mt_sync_frame(td, input);
+
+	input_event_batch_end(input);
 }
 
 static void mt_touch_input_configured(struct hid_device *hdev,
@@ -832,6 +899,17 @@ static void mt_touch_input_configured(struct hid_device *hdev,
 
 	input_mt_init_slots(input, td->maxcontacts, td->mt_flags);
 
+	if (!td->slot_cache) {
+		unsigned size = roundup_pow_of_two(2 * td->maxcontacts);
+
+		td->slot_cache = devm_kzalloc(&hdev->dev, size * sizeof(int),
+					      GFP_KERNEL);
+		if (td->slot_cache) {
+			memset(td->slot_cache, 0xff, size * sizeof(int));
+			td->slot_cache_mask = size - 1;
+		}
+	}
+
 	if (!show_mt) {
 		/* drop multitouch definitions */
 		int axis;
@@ -1071,6 +1149,14 @@ static int mt_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	if (ret)
 		return ret;
 
+	/*
+	 * Without hiddev, mt_event() ignores every usage of the touch report:
+	 * mt_touch_report() handles the whole report at once.
+	 */
+	if (!(hdev->claimed & HID_CLAIMED_HIDDEV))
+		hid_set_report_mode(hdev, HID_INPUT_REPORT, td->mt_report_id,
+				    HID_REPORT_MODE_RAW);
+
 	ret = sysfs_create_group(&hdev->dev.kobj, &mt_attribute_group);
 
 	mt_set_maxcontacts(hdev);
@@ -34,6 +34,9 @@
 #include <linux/hid.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 #include <linux/hidraw.h>
 
@@ -43,6 +46,50 @@ static struct class *hidraw_class;
 static struct hidraw *hidraw_table[HIDRAW_MAX_DEVICES];
 static DEFINE_MUTEX(minors_lock);
 
+/*
+ * Copy as many queued reports as fit in the user buffer, each one behind
+ * a struct hidraw_report_header. The first report is truncated if the
+ * buffer is too small to hold it. Called with read_mutex held.
+ */
+static ssize_t hidraw_read_batch(struct hidraw_list *list, char __user *buffer, size_t count)
+{
+	struct hidraw_report_header header;
+	struct hidraw_report *report;
+	size_t done = 0;
+	size_t len;
+
+	if (count < sizeof(header))
+		return -EINVAL;
+
+	memset(&header, 0, sizeof(header));
+
+	while (list->head != list->tail && count - done >= sizeof(header)) {
+		report = &list->buffer[list->tail];
+		len = report->len;
+
+		if (len > count - done - sizeof(header)) {
+			if (done)
+				break;
+			len = count - sizeof(header);
+		}
+
+		header.len = len;
+		header.timestamp = report->timestamp;
+		if (copy_to_user(buffer + done, &header, sizeof(header)) ||
+		    copy_to_user(buffer + done + sizeof(header), report->value, len))
+			return done ? done : -EFAULT;
+
+		done = min(count, ALIGN(done + sizeof(header) + len,
+					HIDRAW_BATCH_ALIGN));
+
+		kfree(report->value);
+		report->value = NULL;
+		list->tail = (list->tail + 1) & (list->buffer_size - 1);
+	}
+
+	return done;
+}
+
 static ssize_t hidraw_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos)
 {
 	struct hidraw_list *list = file->private_data;
@@ -51,6 +98,12 @@ static ssize_t hidraw_read(struct file *file, char __user *buffer, size_t count,
 
 	mutex_lock(&list->read_mutex);
 
+	/* reports are delivered through the memory mapped ring */
+	if (list->ring) {
+		ret = -EINVAL;
+		goto out;
+	}
+
 	while (ret == 0) {
 		if (list->head == list->tail) {
 			add_wait_queue(&list->hidraw->wait, &wait);
@@ -84,6 +137,11 @@ static ssize_t hidraw_read(struct file *file, char __user *buffer, size_t count,
 		if (ret)
 			goto out;
 
+		if (list->batch_read) {
+			ret = hidraw_read_batch(list, buffer, count);
+			goto out;
+		}
+
 		len = list->buffer[list->tail].len > count ?
 			count : list->buffer[list->tail].len;
 
@@ -97,7 +155,7 @@ static ssize_t hidraw_read(struct file *file, char __user *buffer, size_t count,
 
 		kfree(list->buffer[list->tail].value);
 		list->buffer[list->tail].value = NULL;
-		list->tail = (list->tail + 1) & (HIDRAW_BUFFER_SIZE - 1);
+		list->tail = (list->tail + 1) & (list->buffer_size - 1);
 	}
 out:
 	mutex_unlock(&list->read_mutex);
@@ -241,7 +299,12 @@ static unsigned int hidraw_poll(struct file *file, poll_table *wait)
 	struct hidraw_list *list = file->private_data;
 
 	poll_wait(file, &list->hidraw->wait, wait);
-	if (list->head != list->tail)
+	if (list->ring) {
+		struct hidraw_ring_header *hdr = list->ring;
+
+		if (list->ring_head != ACCESS_ONCE(hdr->tail))
+			return POLLIN | POLLRDNORM;
+	} else if (list->head != list->tail)
 		return POLLIN | POLLRDNORM;
 	if (!list->hidraw->exist)
 		return POLLERR | POLLHUP;
@@ -261,6 +324,14 @@ static int hidraw_open(struct inode *inode, struct file *file)
 		goto out;
 	}
 
+	list->buffer_size = HIDRAW_BUFFER_SIZE;
+	list->buffer = kcalloc(list->buffer_size, sizeof(*list->buffer),
+			       GFP_KERNEL);
+	if (!list->buffer) {
+		err = -ENOMEM;
+		goto out;
+	}
+
 	mutex_lock(&minors_lock);
 	if (!hidraw_table[minor] || !hidraw_table[minor]->exist) {
 		err = -ENODEV;
@@ -292,8 +363,10 @@ static int hidraw_open(struct inode *inode, struct file *file)
 out_unlock:
 	mutex_unlock(&minors_lock);
 out:
-	if (err < 0)
+	if (err < 0 && list) {
+		kfree(list->buffer);
 		kfree(list);
+	}
 	return err;
 
 }
@@ -330,6 +403,14 @@ static void drop_ref(struct hidraw *hidraw, int exists_bit)
 	}
 }
 
+static void hidraw_free_buffer(struct hidraw_list *list)
+{
+	for (; list->tail != list->head;
+	     list->tail = (list->tail + 1) & (list->buffer_size - 1))
+		kfree(list->buffer[list->tail].value);
+	kfree(list->buffer);
+}
+
 static int hidraw_release(struct inode * inode, struct file * file)
 {
 	unsigned int minor = iminor(inode);
@@ -341,6 +422,8 @@ static int hidraw_release(struct inode * inode, struct file * file)
 	spin_lock_irqsave(&hidraw_table[minor]->list_lock, flags);
 	list_del(&list->node);
 	spin_unlock_irqrestore(&hidraw_table[minor]->list_lock, flags);
+	hidraw_free_buffer(list);
+	vfree(list->ring);
 	kfree(list);
 
 	drop_ref(hidraw_table[minor], 0);
@@ -349,6 +432,171 @@ static int hidraw_release(struct inode * inode, struct file * file)
 	return 0;
 }
 
+/*
+ * Size of the largest input report of the device, including the report
+ * number.
+ */
+static unsigned int hidraw_max_input_len(struct hid_device *hid)
+{
+	struct hid_report_enum *report_enum = hid->report_enum + HID_INPUT_REPORT;
+	struct hid_report *report;
+	unsigned int len, max_len = 0;
+
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		if (!report->size)
+			continue;
+		len = ((report->size - 1) >> 3) + 1 + (report_enum->numbered ? 1 : 0);
+		max_len = max(max_len, len);
+	}
+
+	return max_len ? max_len : HID_MAX_BUFFER_SIZE;
+}
+
+/*
+ * Queue a report in the memory mapped ring. Called with list_lock held.
+ * Returns false if the ring was full and the report was dropped.
+ */
+static bool hidraw_ring_queue(struct hidraw_list *list, u8 *data, int len,
+			      u64 timestamp)
+{
+	struct hidraw_ring_header *hdr = list->ring;
+	struct hidraw_ring_slot *slot;
+	unsigned int index;
+
+	/* tail is owned by userspace, do not trust it beyond this check */
+	if (list->ring_head - ACCESS_ONCE(hdr->tail) >= list->ring_slots) {
+		hdr->dropped = ++list->ring_dropped;
+		return false;
+	}
+
+	/* make sure the slot is not overwritten before userspace is done */
+	smp_mb();
+
+	index = list->ring_head & (list->ring_slots - 1);
+	slot = list->ring + PAGE_SIZE + index * list->ring_slot_size;
+	len = min_t(int, len, list->ring_slot_size - sizeof(*slot));
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	slot->timestamp = timestamp;
+
+	/* publish the slot content before the new head */
+	smp_wmb();
+	hdr->head = ++list->ring_head;
+	return true;
+}
+
+static int hidraw_setup_ring(struct hidraw_list *list, __u32 slots)
+{
+	struct hidraw_ring_header *hdr;
+	unsigned int slot_size;
+	unsigned long flags;
+	void *ring;
+	int ret = 0;
+
+	if (!slots || slots > HIDRAW_MAX_RING_SLOTS || !is_power_of_2(slots))
+		return -EINVAL;
+
+	slot_size = ALIGN(sizeof(struct hidraw_ring_slot) +
+			  hidraw_max_input_len(list->hidraw->hid), 8);
+
+	ring = vmalloc_user(PAGE_SIZE + slots * slot_size);
+	if (!ring)
+		return -ENOMEM;
+
+	hdr = ring;
+	hdr->slots = slots;
+	hdr->slot_size = slot_size;
+	hdr->data_offset = PAGE_SIZE;
+
+	mutex_lock(&list->read_mutex);
+	spin_lock_irqsave(&list->hidraw->list_lock, flags);
+	if (list->ring) {
+		ret = -EBUSY;
+	} else {
+		list->ring_slots = slots;
+		list->ring_slot_size = slot_size;
+		list->ring_head = 0;
+		list->ring_dropped = 0;
+		list->ring = ring;
+
+		/* move the reports read() did not consume yet to the ring */
+		while (list->tail != list->head) {
+			struct hidraw_report *report = &list->buffer[list->tail];
+
+			hidraw_ring_queue(list, report->value, report->len,
+					  report->timestamp);
+			kfree(report->value);
+			report->value = NULL;
+			list->tail = (list->tail + 1) & (list->buffer_size - 1);
+		}
+	}
+	spin_unlock_irqrestore(&list->hidraw->list_lock, flags);
+	mutex_unlock(&list->read_mutex);
+
+	if (ret)
+		vfree(ring);
+	return ret;
+}
+
+static int hidraw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct hidraw_list *list = file->private_data;
+	int ret;
+
+	mutex_lock(&list->read_mutex);
+	if (!list->ring || vma->vm_pgoff)
+		ret = -EINVAL;
+	else
+		ret = remap_vmalloc_range(vma, list->ring, 0);
+	mutex_unlock(&list->read_mutex);
+
+	return ret;
+}
+
+/*
+ * Replace the report queue of a reader. Pending reports are kept in order,
+ * the ones that do not fit in the new queue are dropped and accounted as
+ * overruns.
+ */
+static int hidraw_set_queue_depth(struct hidraw_list *list, __u32 depth)
+{
+	struct hidraw_report *buffer, *old_buffer;
+	unsigned long flags;
+	int head = 0;
+
+	if (depth < 2 || depth > HIDRAW_MAX_BUFFER_SIZE || !is_power_of_2(depth))
+		return -EINVAL;
+
+	buffer = kcalloc(depth, sizeof(*buffer), GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	mutex_lock(&list->read_mutex);
+	spin_lock_irqsave(&list->hidraw->list_lock, flags);
+
+	old_buffer = list->buffer;
+	for (; list->tail != list->head;
+	     list->tail = (list->tail + 1) & (list->buffer_size - 1)) {
+		if (head < depth - 1) {
+			buffer[head++] = old_buffer[list->tail];
+		} else {
+			kfree(old_buffer[list->tail].value);
+			list->overruns++;
+		}
+	}
+
+	list->buffer = buffer;
+	list->buffer_size = depth;
+	list->head = head;
+	list->tail = 0;
+
+	spin_unlock_irqrestore(&list->hidraw->list_lock, flags);
+	mutex_unlock(&list->read_mutex);
+
+	kfree(old_buffer);
+	return 0;
+}
+
 static long hidraw_ioctl(struct file *file, unsigned int cmd,
 							unsigned long arg)
 {
@@ -356,6 +604,7 @@ static long hidraw_ioctl(struct file *file, unsigned int cmd,
 	unsigned int minor = iminor(inode);
 	long ret = 0;
 	struct hidraw *dev;
+	struct hidraw_list *list = file->private_data;
 	void __user *user_arg = (void __user*) arg;
 
 	mutex_lock(&minors_lock);
@@ -398,6 +647,52 @@ static long hidraw_ioctl(struct file *file, unsigned int cmd,
 					ret = -EFAULT;
 				break;
 			}
+		case HIDIOCSRING:
+			{
+				__u32 slots;
+
+				if (get_user(slots, (__u32 __user *)arg))
+					ret = -EFAULT;
+				else
+					ret = hidraw_setup_ring(list, slots);
+				break;
+			}
+		case HIDIOCSQUEUEDEPTH:
+			{
+				__u32 depth;
+
+				if (get_user(depth, (__u32 __user *)arg))
+					ret = -EFAULT;
+				else
+					ret = hidraw_set_queue_depth(list, depth);
+				break;
+			}
+		case HIDIOCGQUEUEINFO:
+			{
+				struct hidraw_queue_info info;
+				unsigned long flags;
+
+				spin_lock_irqsave(&dev->list_lock, flags);
+				info.depth = list->buffer_size;
+				info.overruns = list->overruns;
+				spin_unlock_irqrestore(&dev->list_lock, flags);
+				if (copy_to_user(user_arg, &info, sizeof(info)))
+					ret = -EFAULT;
+				break;
+			}
+		case HIDIOCSBATCHREAD:
+			{
+				__u32 enable;
+
+				if (get_user(enable, (__u32 __user *)arg)) {
+					ret = -EFAULT;
+					break;
+				}
+				mutex_lock(&list->read_mutex);
+				list->batch_read = !!enable;
+				mutex_unlock(&list->read_mutex);
+				break;
+			}
 		default:
 			{
 				struct hid_device *hid = dev->hid;
@@ -458,6 +753,7 @@ static const struct file_operations hidraw_ops = {
 	.release =      hidraw_release,
 	.unlocked_ioctl = hidraw_ioctl,
 	.fasync =	hidraw_fasync,
+	.mmap =		hidraw_mmap,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl   = hidraw_ioctl,
 #endif
@@ -473,16 +769,27 @@ int hidraw_report_event(struct hid_device *hid, u8 *data, int len)
 
 	spin_lock_irqsave(&dev->list_lock, flags);
 	list_for_each_entry(list, &dev->list, node) {
-		int new_head = (list->head + 1) & (HIDRAW_BUFFER_SIZE - 1);
+		int new_head = (list->head + 1) & (list->buffer_size - 1);
 
-		if (new_head == list->tail)
+		if (list->ring) {
+			if (hidraw_ring_queue(list, data, len,
+					      hid->input_timestamp))
+				kill_fasync(&list->fasync, SIGIO, POLL_IN);
 			continue;
+		}
+
+		if (new_head == list->tail) {
+			list->overruns++;
+			continue;
+		}
 
 		if (!(list->buffer[list->head].value = kmemdup(data, len, GFP_ATOMIC))) {
+			list->overruns++;
 			ret = -ENOMEM;
 			break;
 		}
 		list->buffer[list->head].len = len;
+		list->buffer[list->head].timestamp = hid->input_timestamp;
 		list->head = new_head;
 		kill_fasync(&list->fasync, SIGIO, POLL_IN);
 	}
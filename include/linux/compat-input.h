@@ -136,6 +136,10 @@ struct input_value {
  * @num_vals: number of values queued in the current frame
  * @max_vals: maximum number of values queued in a frame
  * @vals: array of values queued in the current frame
+ * @batch_cpu: CPU holding input.event_lock for a batch of events, -1 if none
+ * @batch_flags: interrupt state saved when the batch started
+ * @keys_pressed: number of bits set in input.key by input_event(), updated
+ *	under input.event_lock
  */
 struct __compat_input_dev {
 	struct input_dev input;
@@ -145,6 +149,11 @@ struct __compat_input_dev {
 	unsigned int max_vals;
 	struct input_value *vals;
 
+	int batch_cpu;
+	unsigned long batch_flags;
+
+	unsigned int keys_pressed;
+
 	/* private */
 	void *p;
 	void *p1;
@@ -170,6 +179,9 @@ static inline void input_set_mt(struct input_dev *dev, struct input_mt *mt)
 		_dev->mt = mt;
 }
 
+void input_event_batch_begin(struct input_dev *dev);
+void input_event_batch_end(struct input_dev *dev);
+
 #ifndef kstrtoul
 #define kstrtoul strict_strtoul
 #endif
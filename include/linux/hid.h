@@ -32,6 +32,7 @@
 #include <linux/list.h>
 #include <linux/mod_devicetable.h> /* hid_device_id */
 #include <linux/timer.h>
+#include <linux/ktime.h>
 #include <linux/workqueue.h>
 #include <linux/compat-input.h>
 #include <linux/semaphore.h>
@@ -289,6 +290,7 @@ struct hid_item {
 #define HID_QUIRK_HIDINPUT_FORCE		0x00000080
 #define HID_QUIRK_NO_EMPTY_INPUT		0x00000100
 #define HID_QUIRK_NO_INIT_INPUT_REPORTS		0x00000200
+#define HID_QUIRK_DEFERRED_INPUT		0x00000400
 #define HID_QUIRK_SKIP_OUTPUT_REPORTS		0x00010000
 #define HID_QUIRK_FULLSPEED_INTERVAL		0x10000000
 #define HID_QUIRK_NO_INIT_REPORTS		0x20000000
@@ -328,10 +330,12 @@ struct hid_global {
 
 #define HID_MAX_USAGES			12288
 #define HID_DEFAULT_NUM_COLLECTIONS	16
+#define HID_DEFAULT_NUM_USAGES		64
 
 struct hid_local {
-	unsigned usage[HID_MAX_USAGES]; /* usage array */
-	unsigned collection_index[HID_MAX_USAGES]; /* collection index array */
+	unsigned *usage; /* usage array, grown up to HID_MAX_USAGES */
+	unsigned *collection_index; /* collection index array */
+	unsigned usage_size; /* allocated entries of both arrays */
 	unsigned usage_index;
 	unsigned usage_minimum;
 	unsigned delimiter_depth;
@@ -359,8 +363,16 @@ struct hid_usage {
 	__s8	  hat_min;		/* hat switch fun */
 	__s8	  hat_max;		/* ditto */
 	__s8	  hat_dir;		/* ditto */
+	__u8	  dispatch;		/* HID_DISPATCH_*, see hid_connect() */
 };
 
+/*
+ * Cached results of matching the bound driver's usage_table and report_table,
+ * valid while hid_device->dispatch_cached is set.
+ */
+#define HID_DISPATCH_EVENT	0x01	/* call driver->event() */
+#define HID_DISPATCH_RAW_EVENT	0x02	/* call driver->raw_event() */
+
 struct hid_input;
 
 struct hid_field {
@@ -374,7 +386,11 @@ struct hid_field {
 	unsigned  report_size;		/* size of this field in the report */
 	unsigned  report_count;		/* number of this field in the report */
 	unsigned  report_type;		/* (input,output,feature) */
+	unsigned  decode;		/* decode plan for incoming values */
 	__s32    *value;		/* last known value(s) */
+	__s32    *new_value;		/* newly read value(s) */
+	unsigned long *usage_bits;	/* array fields: usages in value */
+	unsigned long *new_usage_bits;	/* array fields: usages in new_value */
 	__s32     logical_minimum;
 	__s32     logical_maximum;
 	__s32     physical_minimum;
@@ -394,12 +410,24 @@ struct hid_report {
 	struct list_head list;
 	unsigned id;					/* id of this report */
 	unsigned type;					/* report type */
-	struct hid_field *field[HID_MAX_FIELDS];	/* fields of the report */
+	struct hid_field **field;			/* fields of the report */
 	unsigned maxfield;				/* maximum valid field index */
+	unsigned field_size;				/* allocated entries of field[] */
 	unsigned size;					/* size of the report (bits) */
+	unsigned dispatch;				/* HID_DISPATCH_* */
+	unsigned mode;					/* HID_REPORT_MODE_*, set by the driver */
 	struct hid_device *device;			/* associated device */
 };
 
+/*
+ * How an input report is processed. Drivers that consume a whole report in
+ * raw_event() or report() can skip the generic per-usage dispatch (driver
+ * event(), hid-input, hiddev); field values are still updated for report().
+ */
+#define HID_REPORT_MODE_BOTH	0	/* raw_event() and per-usage dispatch */
+#define HID_REPORT_MODE_RAW	1	/* raw_event() and report() only */
+#define HID_REPORT_MODE_FIELDS	2	/* per-usage dispatch only */
+
 #define HID_MAX_IDS 256
 
 struct hid_report_enum {
@@ -413,6 +441,23 @@ struct hid_report_enum {
 #define HID_CONTROL_FIFO_SIZE	256		/* to init devices with >100 reports */
 #define HID_OUTPUT_FIFO_SIZE	64
 
+#define HID_STAGING_SLOTS	32		/* reports kept while the driver is busy */
+#define HID_STAGING_BOUNCE_SIZE	(HID_MAX_BUFFER_SIZE + 1 + 7)	/* report id, data, extract() slack */
+
+/*
+ * An input report received while driver_input_lock was held, waiting to be
+ * processed by hid_input_report(). data points into hid->staging_pool, or
+ * to a buffer of its own (allocated set) when the report does not fit.
+ */
+struct hid_staged_report {
+	u64 timestamp;
+	int type;
+	int size;
+	int interrupt;
+	bool allocated;
+	u8 *data;
+};
+
 struct hid_control_fifo {
 	unsigned char dir;
 	struct hid_report *report;
@@ -488,6 +533,20 @@ struct hid_device {							/* device report descriptor */
 	unsigned claimed;						/* Claimed by hidinput, hiddev? */
 	unsigned quirks;						/* Various quirks the device can pull on us */
 	bool io_started;						/* Protected by driver_lock. If IO has started */
+	bool dispatch_cached;						/* usage/report dispatch flags are valid */
+	u64 input_timestamp;						/* CLOCK_MONOTONIC ns, arrival of the current input report */
+
+	/* input reports received while driver_input_lock was busy */
+	spinlock_t staging_lock;
+	struct hid_staged_report *staging;
+	u8 *staging_pool;						/* HID_STAGING_SLOTS buffers of staging_stride bytes */
+	unsigned staging_stride;
+	u8 *staging_bounce;						/* staged reports are processed from here */
+	unsigned staging_head;
+	unsigned staging_tail;
+	struct work_struct staging_work;
+	unsigned long staged_reports;					/* reports delayed by a busy driver */
+	unsigned long dropped_reports;					/* reports lost because staging was full */
 
 	struct list_head inputs;					/* The list of inputs */
 	void *hiddev;							/* The hiddev structure */
@@ -537,6 +596,27 @@ static inline void hid_set_drvdata(struct hid_device *hdev, void *data)
 	dev_set_drvdata(&hdev->dev, data);
 }
 
+/**
+ * hid_set_report_mode - select how a parsed report is processed
+ *
+ * @hdev: hid device
+ * @type: HID report type (HID_*_REPORT)
+ * @id: report id
+ * @mode: HID_REPORT_MODE_*
+ */
+static inline void hid_set_report_mode(struct hid_device *hdev, unsigned type,
+				       unsigned id, unsigned mode)
+{
+	struct hid_report *report;
+
+	if (type >= HID_REPORT_TYPES || id >= HID_MAX_IDS)
+		return;
+
+	report = hdev->report_enum[type].report_id_hash[id];
+	if (report)
+		report->mode = mode;
+}
+
 #define HID_GLOBAL_STACK_SIZE 4
 #define HID_COLLECTION_STACK_SIZE 4
 
@@ -631,12 +711,19 @@ struct hid_usage_id {
  * Both these functions may be NULL which means the same behavior as returning
  * zero from them.
  */
+#define HID_DYNID_HASH_BITS	4
+
+struct hid_id_index;
+
 struct hid_driver {
 	char *name;
 	const struct hid_device_id *id_table;
 
 	struct list_head dyn_list;
 	spinlock_t dyn_lock;
+	struct list_head dyn_hash[1 << HID_DYNID_HASH_BITS];	/* dyn_list by id */
+	struct list_head dyn_wild;				/* dyn_list entries with HID_ANY_ID */
+	unsigned long dyn_seq;					/* next dynamic id sequence number */
 
 	int (*probe)(struct hid_device *dev, const struct hid_device_id *id);
 	void (*remove)(struct hid_device *dev);
@@ -670,6 +757,7 @@ struct hid_driver {
 #endif
 /* private: */
 	struct device_driver driver;
+	struct hid_id_index *id_index;	/* sorted id_table, see hid_match_device() */
 };
 
 /**
@@ -750,6 +838,8 @@ extern void hidinput_disconnect(struct hid_device *);
 
 int hid_set_field(struct hid_field *, unsigned, __s32);
 int hid_input_report(struct hid_device *, int type, u8 *, int, int);
+int hid_input_report_timestamp(struct hid_device *, int type, u8 *, int, int,
+			       u64 timestamp);
 int hidinput_find_field(struct hid_device *hid, unsigned int type, unsigned int code, struct hid_field **field);
 struct hid_field *hidinput_get_led_field(struct hid_device *hid);
 unsigned int hidinput_count_leds(struct hid_device *hid);
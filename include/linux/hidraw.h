@@ -30,16 +30,25 @@ struct hidraw {
 struct hidraw_report {
 	__u8 *value;
 	int len;
+	u64 timestamp;
 };
 
 struct hidraw_list {
-	struct hidraw_report buffer[HIDRAW_BUFFER_SIZE];
+	struct hidraw_report *buffer;
+	unsigned int buffer_size;	/* power of two, see HIDIOCSQUEUEDEPTH */
+	unsigned int overruns;		/* reports dropped on a full buffer */
 	int head;
 	int tail;
 	struct fasync_struct *fasync;
 	struct hidraw *hidraw;
 	struct list_head node;
 	struct mutex read_mutex;
+	bool batch_read;		/* see HIDIOCSBATCHREAD */
+	void *ring;			/* mmap-able ring, see HIDIOCSRING */
+	unsigned int ring_slots;
+	unsigned int ring_slot_size;
+	unsigned int ring_head;
+	unsigned int ring_dropped;
 };
 
 #ifdef CONFIG_HIDRAW
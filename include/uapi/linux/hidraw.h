@@ -29,6 +29,57 @@ struct hidraw_devinfo {
 	__s16 product;
 };
 
+struct hidraw_queue_info {
+	__u32 depth;		/* number of entries of the report queue */
+	__u32 overruns;		/* reports dropped because the queue was full */
+};
+
+/*
+ * Memory mapped ring of input reports, enabled with HIDIOCSRING.
+ *
+ * The first page of the mapping holds a struct hidraw_ring_header, the
+ * slots start at data_offset and are slot_size bytes apart. The kernel
+ * fills the slot at (head % slots) and then increments head, userspace
+ * consumes the slot at (tail % slots) and then increments tail. Reports
+ * arriving while the ring is full are counted in dropped.
+ */
+struct hidraw_ring_header {
+	__u32 head;		/* written by the kernel */
+	__u32 tail;		/* written by userspace */
+	__u32 slots;
+	__u32 slot_size;
+	__u32 data_offset;
+	__u32 dropped;
+};
+
+/*
+ * Batched reads, enabled with HIDIOCSBATCHREAD.
+ *
+ * A single read() returns as many queued reports as fit in the buffer.
+ * Each report is preceded by a struct hidraw_report_header, and the next
+ * header starts on the following HIDRAW_BATCH_ALIGN bytes boundary.
+ */
+#define HIDRAW_BATCH_ALIGN	8
+
+struct hidraw_report_header {
+	__u32 len;		/* length of the report following the header */
+	__u32 reserved;
+	__u64 timestamp;	/* see below */
+};
+
+struct hidraw_ring_slot {
+	__u32 len;		/* length of the report in data */
+	__u32 reserved;
+	__u64 timestamp;	/* see below */
+	__u8 data[0];
+};
+
+/*
+ * The timestamp of batched reads and ring slots is the CLOCK_MONOTONIC
+ * time, in nanoseconds, at which the report entered the HID core. It
+ * separates the device to kernel latency from the kernel to userspace one.
+ */
+
 /* ioctl interface */
 #define HIDIOCGRDESCSIZE	_IOR('H', 0x01, int)
 #define HIDIOCGRDESC		_IOR('H', 0x02, struct hidraw_report_descriptor)
@@ -38,11 +89,22 @@ struct hidraw_devinfo {
 /* The first byte of SFEATURE and GFEATURE is the report number */
 #define HIDIOCSFEATURE(len)    _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x06, len)
 #define HIDIOCGFEATURE(len)    _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x07, len)
+/* Switch this reader to a memory mapped ring of the given number of slots */
+#define HIDIOCSRING		_IOW('H', 0x20, __u32)
+/* Enable (non zero) or disable (0) batched reads on this reader */
+#define HIDIOCSBATCHREAD	_IOW('H', 0x21, __u32)
+/* Set the depth of the report queue of this reader (power of two) */
+#define HIDIOCSQUEUEDEPTH	_IOW('H', 0x22, __u32)
+#define HIDIOCGQUEUEINFO	_IOR('H', 0x23, struct hidraw_queue_info)
 
 #define HIDRAW_FIRST_MINOR 0
 #define HIDRAW_MAX_DEVICES 64
-/* number of reports to buffer */
+/* default number of reports to buffer */
 #define HIDRAW_BUFFER_SIZE 64
+/* maximum number of reports to buffer, see HIDIOCSQUEUEDEPTH */
+#define HIDRAW_MAX_BUFFER_SIZE 4096
+/* maximum number of slots of a memory mapped ring */
+#define HIDRAW_MAX_RING_SLOTS 4096
 
 
 /* kernel-only API declarations */
@@ -34,6 +34,8 @@ enum uhid_event_type {
 	UHID_INPUT,
 	UHID_FEATURE,
 	UHID_FEATURE_ANSWER,
+	UHID_INPUT_BATCH,
+	UHID_SET_COMPACT,
 };
 
 struct uhid_create_req {
@@ -63,6 +65,16 @@ struct uhid_input_req {
 	__u16 size;
 } __attribute__((__packed__));
 
+/*
+ * UHID_INPUT_BATCH carries several input reports in a single write(). The
+ * __u32 type is followed by a struct uhid_input_batch_req, then by "count"
+ * reports. Each report is a __u16 size followed by "size" bytes of data,
+ * without any padding. Reports are handed to the HID core in order.
+ */
+struct uhid_input_batch_req {
+	__u16 count;
+} __attribute__((__packed__));
+
 struct uhid_output_req {
 	__u8 data[UHID_DATA_MAX];
 	__u16 size;
@@ -90,12 +102,38 @@ struct uhid_feature_answer_req {
 	__u8 data[UHID_DATA_MAX];
 } __attribute__((__packed__));
 
+/*
+ * Compact wire format, enabled by writing a UHID_SET_COMPACT event in the
+ * regular format. From then on, every event read or written on the file
+ * is a struct uhid_compact_header followed by "size" bytes of payload:
+ *
+ *  - UHID_START, UHID_STOP, UHID_OPEN, UHID_CLOSE, UHID_DESTROY: none
+ *  - UHID_INPUT: the report data
+ *  - UHID_OUTPUT: a struct uhid_output_compact_req and the report data
+ *  - UHID_INPUT_BATCH: as described above, starting at the batch request
+ *  - any other event: the leading bytes of its regular request
+ *
+ * The header starts with "size" so that "type" and the payload are laid
+ * out like a regular event.
+ */
+struct uhid_compact_header {
+	__u32 size;
+	__u32 type;
+} __attribute__((__packed__));
+
+struct uhid_output_compact_req {
+	__u16 size;
+	__u8 rtype;
+	__u8 data[0];
+} __attribute__((__packed__));
+
 struct uhid_event {
 	__u32 type;
 
 	union {
 		struct uhid_create_req create;
 		struct uhid_input_req input;
+		struct uhid_input_batch_req input_batch;
 		struct uhid_output_req output;
 		struct uhid_output_ev_req output_ev;
 		struct uhid_feature_req feature;
@@ -16,6 +16,7 @@
 #include <linux/fs.h>
 #include <linux/hid.h>
 #include <linux/input.h>
+#include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
@@ -23,10 +24,12 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/uhid.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 
 #define UHID_NAME	"uhid"
 #define UHID_BUFSIZE	512
+#define UHID_POOL_SIZE	32	/* preallocated events, ~140KB */
 
 struct uhid_device {
 	struct mutex devlock;
@@ -37,6 +40,7 @@ struct uhid_device {
 
 	struct hid_device *hid;
 	struct uhid_event input_buf;
+	bool compact;		/* see UHID_SET_COMPACT */
 
 	wait_queue_head_t waitq;
 	spinlock_t qlock;
@@ -44,15 +48,101 @@ struct uhid_device {
 	__u8 tail;
 	struct uhid_event *outq[UHID_BUFSIZE];
 
-	struct mutex report_lock;
+	/* preallocated events, protected by qlock */
+	struct uhid_event *pool;
+	struct uhid_event *pool_free[UHID_POOL_SIZE];
+	unsigned int pool_avail;
+	unsigned long pool_exhausted;
+
+	/* outstanding UHID_FEATURE requests, protected by qlock */
+	struct list_head reports;
 	wait_queue_head_t report_wait;
-	atomic_t report_done;
 	atomic_t report_id;
-	struct uhid_event report_buf;
+};
+
+/*
+ * A UHID_FEATURE request waiting for its answer. Several requests can be
+ * outstanding at once; answers are matched by id and may come in any order.
+ */
+struct uhid_report_req {
+	struct list_head list;
+	__u32 id;
+	bool done;
+	int err;
+	__u8 *buf;
+	size_t count;
+	size_t len;
 };
 
 static struct miscdevice uhid_misc;
 
+/*
+ * Events sent to userspace are taken from a pool allocated when the device
+ * is created, so that the output paths do not need to allocate a whole
+ * struct uhid_event, sometimes from atomic context, for each event. The
+ * pool covers the usual backlog; beyond it events are allocated one by one.
+ */
+static int uhid_pool_init(struct uhid_device *uhid)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	if (uhid->pool)
+		return 0;
+
+	uhid->pool = vmalloc(UHID_POOL_SIZE * sizeof(*uhid->pool));
+	if (!uhid->pool)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&uhid->qlock, flags);
+	for (i = 0; i < UHID_POOL_SIZE; ++i)
+		uhid->pool_free[i] = &uhid->pool[i];
+	uhid->pool_avail = UHID_POOL_SIZE;
+	spin_unlock_irqrestore(&uhid->qlock, flags);
+
+	return 0;
+}
+
+static struct uhid_event *uhid_event_get(struct uhid_device *uhid)
+{
+	struct uhid_event *ev = NULL;
+	unsigned long flags;
+	unsigned long exhausted = 0;
+
+	spin_lock_irqsave(&uhid->qlock, flags);
+	if (uhid->pool_avail)
+		ev = uhid->pool_free[--uhid->pool_avail];
+	else
+		exhausted = ++uhid->pool_exhausted;
+	spin_unlock_irqrestore(&uhid->qlock, flags);
+
+	if (ev) {
+		memset(ev, 0, sizeof(*ev));
+		return ev;
+	}
+
+	ev = kzalloc(sizeof(*ev), GFP_ATOMIC);
+	if (!ev && printk_ratelimit())
+		hid_warn(uhid->hid, "Event pool exhausted, out of memory (%lu times)\n",
+			 exhausted);
+	return ev;
+}
+
+static bool uhid_event_in_pool(struct uhid_device *uhid,
+			       struct uhid_event *ev)
+{
+	return ev >= uhid->pool && ev < uhid->pool + UHID_POOL_SIZE;
+}
+
+/* must be called with qlock held */
+static void uhid_event_put(struct uhid_device *uhid, struct uhid_event *ev)
+{
+	if (uhid_event_in_pool(uhid, ev))
+		uhid->pool_free[uhid->pool_avail++] = ev;
+	else
+		kfree(ev);
+}
+
 static void uhid_queue(struct uhid_device *uhid, struct uhid_event *ev)
 {
 	__u8 newhead;
@@ -65,7 +155,7 @@ static void uhid_queue(struct uhid_device *uhid, struct uhid_event *ev)
 		wake_up_interruptible(&uhid->waitq);
 	} else {
 		hid_warn(uhid->hid, "Output queue is full\n");
-		kfree(ev);
+		uhid_event_put(uhid, ev);
 	}
 }
 
@@ -74,7 +164,7 @@ static int uhid_queue_event(struct uhid_device *uhid, __u32 event)
 	unsigned long flags;
 	struct uhid_event *ev;
 
-	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	ev = uhid_event_get(uhid);
 	if (!ev)
 		return -ENOMEM;
 
@@ -124,7 +214,7 @@ static int uhid_hid_input(struct input_dev *input, unsigned int type,
 	unsigned long flags;
 	struct uhid_event *ev;
 
-	ev = kzalloc(sizeof(*ev), GFP_ATOMIC);
+	ev = uhid_event_get(uhid);
 	if (!ev)
 		return -ENOMEM;
 
@@ -155,8 +245,7 @@ static int uhid_hid_get_raw(struct hid_device *hid, unsigned char rnum,
 	struct uhid_event *ev;
 	unsigned long flags;
 	int ret;
-	size_t uninitialized_var(len);
-	struct uhid_feature_answer_req *req;
+	struct uhid_report_req req;
 
 	if (!uhid->running)
 		return -EIO;
@@ -175,15 +264,13 @@ static int uhid_hid_get_raw(struct hid_device *hid, unsigned char rnum,
 		return -EINVAL;
 	}
 
-	ret = mutex_lock_interruptible(&uhid->report_lock);
-	if (ret)
-		return ret;
+	ev = uhid_event_get(uhid);
+	if (!ev)
+		return -ENOMEM;
 
-	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
-	if (!ev) {
-		ret = -ENOMEM;
-		goto unlock;
-	}
+	req.buf = buf;
+	req.count = count;
+	req.done = false;
 
 	spin_lock_irqsave(&uhid->qlock, flags);
 	ev->type = UHID_FEATURE;
@@ -191,43 +278,26 @@ static int uhid_hid_get_raw(struct hid_device *hid, unsigned char rnum,
 	ev->u.feature.rnum = rnum;
 	ev->u.feature.rtype = report_type;
 
-	atomic_set(&uhid->report_done, 0);
+	req.id = ev->u.feature.id;
+	list_add_tail(&req.list, &uhid->reports);
 	uhid_queue(uhid, ev);
 	spin_unlock_irqrestore(&uhid->qlock, flags);
 
 	ret = wait_event_interruptible_timeout(uhid->report_wait,
-				atomic_read(&uhid->report_done), 5 * HZ);
-
-	/*
-	 * Make sure "uhid->running" is cleared on shutdown before
-	 * "uhid->report_done" is set.
-	 */
-	smp_rmb();
-	if (!ret || !uhid->running) {
-		ret = -EIO;
-	} else if (ret < 0) {
-		ret = -ERESTARTSYS;
-	} else {
-		spin_lock_irqsave(&uhid->qlock, flags);
-		req = &uhid->report_buf.u.feature_answer;
-
-		if (req->err) {
-			ret = -EIO;
-		} else {
-			ret = 0;
-			len = min(count,
-				min_t(size_t, req->size, UHID_DATA_MAX));
-			memcpy(buf, req->data, len);
-		}
+				req.done || !uhid->running, 5 * HZ);
 
-		spin_unlock_irqrestore(&uhid->qlock, flags);
-	}
+	spin_lock_irqsave(&uhid->qlock, flags);
+	if (!req.done)
+		list_del(&req.list);
+	spin_unlock_irqrestore(&uhid->qlock, flags);
 
-	atomic_set(&uhid->report_done, 1);
+	/* an answer that raced with the timeout still counts */
+	if (!req.done)
+		ret = ret < 0 ? -ERESTARTSYS : -EIO;
+	else
+		ret = req.err;
 
-unlock:
-	mutex_unlock(&uhid->report_lock);
-	return ret ? ret : len;
+	return ret ? ret : req.len;
 }
 
 static int uhid_hid_output_raw(struct hid_device *hid, __u8 *buf, size_t count,
@@ -252,7 +322,7 @@ static int uhid_hid_output_raw(struct hid_device *hid, __u8 *buf, size_t count,
 	if (count < 1 || count > UHID_DATA_MAX)
 		return -EINVAL;
 
-	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	ev = uhid_event_get(uhid);
 	if (!ev)
 		return -ENOMEM;
 
@@ -378,6 +448,10 @@ static int uhid_dev_create(struct uhid_device *uhid,
 	if (uhid->rd_size <= 0 || uhid->rd_size > HID_MAX_DESCRIPTOR_SIZE)
 		return -EINVAL;
 
+	ret = uhid_pool_init(uhid);
+	if (ret)
+		return ret;
+
 	uhid->rd_data = kmalloc(uhid->rd_size, GFP_KERNEL);
 	if (!uhid->rd_data)
 		return -ENOMEM;
@@ -437,11 +511,9 @@ static int uhid_dev_destroy(struct uhid_device *uhid)
 	if (!uhid->running)
 		return -EINVAL;
 
-	/* clear "running" before setting "report_done" */
+	/* fail all outstanding feature requests */
 	uhid->running = false;
-	smp_wmb();
-	atomic_set(&uhid->report_done, 1);
-	wake_up_interruptible(&uhid->report_wait);
+	wake_up_interruptible_all(&uhid->report_wait);
 
 	hid_destroy_device(uhid->hid);
 	kfree(uhid->rd_data);
@@ -460,9 +532,57 @@ static int uhid_dev_input(struct uhid_device *uhid, struct uhid_event *ev)
 	return 0;
 }
 
+/*
+ * Inject the reports of a UHID_INPUT_BATCH event, see uhid.h for the
+ * format. Called with devlock held, so the whole batch is processed with
+ * a single lock acquisition. On a malformed report, the number of bytes
+ * consumed so far is returned. A bad user pointer gives -EFAULT.
+ */
+static ssize_t uhid_dev_input_batch(struct uhid_device *uhid,
+				    const char __user *buffer, size_t count)
+{
+	struct uhid_input_batch_req req;
+	__u8 *data = uhid->input_buf.u.input.data;
+	size_t offset = sizeof(__u32) + sizeof(req);
+	__u16 size;
+	unsigned int i;
+
+	if (!uhid->running)
+		return -EINVAL;
+
+	if (count < offset)
+		return -EINVAL;
+
+	if (copy_from_user(&req, buffer + sizeof(__u32), sizeof(req)))
+		return -EFAULT;
+
+	for (i = 0; i < req.count; i++) {
+		if (count - offset < sizeof(size))
+			break;
+		if (copy_from_user(&size, buffer + offset, sizeof(size)))
+			return -EFAULT;
+		if (size > UHID_DATA_MAX ||
+		    count - offset - sizeof(size) < size)
+			break;
+		if (copy_from_user(data, buffer + offset + sizeof(size), size))
+			return -EFAULT;
+
+		offset += sizeof(size) + size;
+		hid_input_report(uhid->hid, HID_INPUT_REPORT, data, size, 0);
+	}
+
+	if (i < req.count)
+		return i ? offset : -EINVAL;
+
+	/* return "count" not "offset" to not confuse the caller */
+	return count;
+}
+
 static int uhid_dev_feature_answer(struct uhid_device *uhid,
 				   struct uhid_event *ev)
 {
+	struct uhid_feature_answer_req *answer = &ev->u.feature_answer;
+	struct uhid_report_req *req;
 	unsigned long flags;
 
 	if (!uhid->running)
@@ -470,17 +590,26 @@ static int uhid_dev_feature_answer(struct uhid_device *uhid,
 
 	spin_lock_irqsave(&uhid->qlock, flags);
 
-	/* id for old report; drop it silently */
-	if (atomic_read(&uhid->report_id) != ev->u.feature_answer.id)
-		goto unlock;
-	if (atomic_read(&uhid->report_done))
-		goto unlock;
+	/* unknown ids are for requests that timed out; drop them silently */
+	list_for_each_entry(req, &uhid->reports, list) {
+		if (req->id != answer->id)
+			continue;
 
-	memcpy(&uhid->report_buf, ev, sizeof(*ev));
-	atomic_set(&uhid->report_done, 1);
-	wake_up_interruptible(&uhid->report_wait);
+		if (answer->err) {
+			req->err = -EIO;
+		} else {
+			req->err = 0;
+			req->len = min(req->count,
+				min_t(size_t, answer->size, UHID_DATA_MAX));
+			memcpy(req->buf, answer->data, req->len);
+		}
+
+		list_del(&req->list);
+		req->done = true;
+		wake_up_interruptible_all(&uhid->report_wait);
+		break;
+	}
 
-unlock:
 	spin_unlock_irqrestore(&uhid->qlock, flags);
 	return 0;
 }
@@ -494,12 +623,11 @@ static int uhid_char_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	mutex_init(&uhid->devlock);
-	mutex_init(&uhid->report_lock);
 	spin_lock_init(&uhid->qlock);
 	init_waitqueue_head(&uhid->waitq);
 	init_waitqueue_head(&uhid->report_wait);
 	uhid->running = false;
-	atomic_set(&uhid->report_done, 1);
+	INIT_LIST_HEAD(&uhid->reports);
 
 	file->private_data = uhid;
 	nonseekable_open(inode, file);
@@ -510,18 +638,71 @@ static int uhid_char_open(struct inode *inode, struct file *file)
 static int uhid_char_release(struct inode *inode, struct file *file)
 {
 	struct uhid_device *uhid = file->private_data;
-	unsigned int i;
 
 	uhid_dev_destroy(uhid);
 
-	for (i = 0; i < UHID_BUFSIZE; ++i)
-		kfree(uhid->outq[i]);
-
+	for (; uhid->tail != uhid->head;
+	     uhid->tail = (uhid->tail + 1) % UHID_BUFSIZE)
+		if (!uhid_event_in_pool(uhid, uhid->outq[uhid->tail]))
+			kfree(uhid->outq[uhid->tail]);
+	vfree(uhid->pool);
 	kfree(uhid);
 
 	return 0;
 }
 
+/*
+ * Copy an event to userspace in the compact format, only sending the bytes
+ * actually used. Report data is truncated if the buffer is too small.
+ */
+static ssize_t uhid_compact_to_user(struct uhid_event *ev,
+				    char __user *buffer, size_t count)
+{
+	struct uhid_compact_header hdr;
+	struct uhid_output_compact_req out;
+	const void *req = NULL;
+	const void *data = NULL;
+	size_t req_len = 0;
+	size_t data_len = 0;
+
+	switch (ev->type) {
+	case UHID_OUTPUT:
+		req = &out;
+		req_len = sizeof(out);
+		data = ev->u.output.data;
+		data_len = min_t(size_t, ev->u.output.size, UHID_DATA_MAX);
+		break;
+	case UHID_OUTPUT_EV:
+		req = &ev->u.output_ev;
+		req_len = sizeof(ev->u.output_ev);
+		break;
+	case UHID_FEATURE:
+		req = &ev->u.feature;
+		req_len = sizeof(ev->u.feature);
+		break;
+	}
+
+	if (count < sizeof(hdr) + req_len)
+		return -EINVAL;
+
+	data_len = min(data_len, count - sizeof(hdr) - req_len);
+
+	if (ev->type == UHID_OUTPUT) {
+		out.size = data_len;
+		out.rtype = ev->u.output.rtype;
+	}
+
+	hdr.size = req_len + data_len;
+	hdr.type = ev->type;
+
+	if (copy_to_user(buffer, &hdr, sizeof(hdr)) ||
+	    copy_to_user(buffer + sizeof(hdr), req, req_len) ||
+	    copy_to_user(buffer + sizeof(hdr) + req_len, data, data_len))
+		return -EFAULT;
+
+	return sizeof(hdr) + hdr.size;
+}
+
 static ssize_t uhid_char_read(struct file *file, char __user *buffer,
 				size_t count, loff_t *ppos)
 {
@@ -529,6 +710,7 @@ static ssize_t uhid_char_read(struct file *file, char __user *buffer,
 	int ret;
 	unsigned long flags;
 	size_t len;
+	ssize_t written;
 
 	/* they need at least the "type" member of uhid_event */
 	if (count < sizeof(__u32))
@@ -553,14 +735,21 @@ try_again:
 		mutex_unlock(&uhid->devlock);
 		goto try_again;
 	} else {
-		len = min(count, sizeof(**uhid->outq));
-		if (copy_to_user(buffer, uhid->outq[uhid->tail], len)) {
-			ret = -EFAULT;
+		if (uhid->compact) {
+			written = uhid_compact_to_user(uhid->outq[uhid->tail],
+						       buffer, count);
+			ret = written < 0 ? written : 0;
+			len = written;
 		} else {
-			kfree(uhid->outq[uhid->tail]);
-			uhid->outq[uhid->tail] = NULL;
+			len = min(count, sizeof(**uhid->outq));
+			if (copy_to_user(buffer, uhid->outq[uhid->tail], len))
+				ret = -EFAULT;
+		}
 
+		if (!ret) {
 			spin_lock_irqsave(&uhid->qlock, flags);
+			uhid_event_put(uhid, uhid->outq[uhid->tail]);
+			uhid->outq[uhid->tail] = NULL;
 			uhid->tail = (uhid->tail + 1) % UHID_BUFSIZE;
 			spin_unlock_irqrestore(&uhid->qlock, flags);
 		}
@@ -574,8 +763,13 @@ static ssize_t uhid_char_write(struct file *file, const char __user *buffer,
 				size_t count, loff_t *ppos)
 {
 	struct uhid_device *uhid = file->private_data;
+	struct uhid_compact_header hdr;
+	const char __user *event = buffer;
+	size_t event_len = count;
 	int ret;
 	size_t len;
+	ssize_t written;
+	__u32 type;
 
 	/* we need at least the "type" member of uhid_event */
 	if (count < sizeof(__u32))
@@ -585,12 +779,64 @@ static ssize_t uhid_char_write(struct file *file, const char __user *buffer,
 	if (ret)
 		return ret;
 
-	memset(&uhid->input_buf, 0, sizeof(uhid->input_buf));
-	len = min(count, sizeof(uhid->input_buf));
+	/*
+	 * In compact mode, skip the "size" member of the header: "type" and
+	 * the payload are then laid out like a regular event.
+	 */
+	if (uhid->compact) {
+		if (count < sizeof(hdr)) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+		if (copy_from_user(&hdr, buffer, sizeof(hdr))) {
+			ret = -EFAULT;
+			goto unlock;
+		}
+		if (hdr.size > count - sizeof(hdr)) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+		event = buffer + sizeof(hdr.size);
+		event_len = sizeof(hdr.type) + hdr.size;
+	}
 
-	ret = uhid_event_from_user(buffer, len, &uhid->input_buf);
-	if (ret)
+	if (get_user(type, (const __u32 __user *)event)) {
+		ret = -EFAULT;
 		goto unlock;
+	}
+
+	/* batches are larger than struct uhid_event, parse them in place */
+	if (type == UHID_INPUT_BATCH) {
+		written = uhid_dev_input_batch(uhid, event, event_len);
+		mutex_unlock(&uhid->devlock);
+		if (written < 0)
+			return written;
+		/* account for the compact header on partial writes */
+		return written == event_len ? count : written + (event - buffer);
+	}
+
+	memset(&uhid->input_buf, 0, sizeof(uhid->input_buf));
+
+	if (uhid->compact && type == UHID_INPUT) {
+		/* the payload is the bare report */
+		if (hdr.size > UHID_DATA_MAX) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+		uhid->input_buf.type = UHID_INPUT;
+		uhid->input_buf.u.input.size = hdr.size;
+		if (copy_from_user(uhid->input_buf.u.input.data,
+				   buffer + sizeof(hdr), hdr.size)) {
+			ret = -EFAULT;
+			goto unlock;
+		}
+	} else {
+		len = min(event_len, sizeof(uhid->input_buf));
+
+		ret = uhid_event_from_user(event, len, &uhid->input_buf);
+		if (ret)
+			goto unlock;
+	}
 
 	switch (uhid->input_buf.type) {
 	case UHID_CREATE:
@@ -605,6 +851,10 @@ static ssize_t uhid_char_write(struct file *file, const char __user *buffer,
 	case UHID_FEATURE_ANSWER:
 		ret = uhid_dev_feature_answer(uhid, &uhid->input_buf);
 		break;
+	case UHID_SET_COMPACT:
+		uhid->compact = true;
+		ret = 0;
+		break;
 	default:
 		ret = -EOPNOTSUPP;
 	}
@@ -31,6 +31,7 @@
 #include <linux/wait.h>
 #include <linux/workqueue.h>
 #include <linux/string.h>
+#include <linux/vmalloc.h>
 
 #include <linux/usb.h>
 
@@ -59,6 +60,22 @@ static unsigned int ignoreled;
 module_param_named(ignoreled, ignoreled, uint, 0644);
 MODULE_PARM_DESC(ignoreled, "Autosuspend with active leds");
 
+static unsigned int hid_in_urbs = 1;
+module_param_named(inurbs, hid_in_urbs, uint, 0444);
+MODULE_PARM_DESC(inurbs, "Number of interrupt-in URBs kept in flight (1-8)");
+
+static int hid_deferred_cpu = -1;
+module_param_named(deferredcpu, hid_deferred_cpu, int, 0644);
+MODULE_PARM_DESC(deferredcpu, "CPU processing the input of devices with "
+		"the deferred input quirk (-1 for any)");
+
+static unsigned int hid_coalesce;
+module_param_named(coalesce, hid_coalesce, uint, 0644);
+MODULE_PARM_DESC(coalesce, "Replace queued reports that have not been "
+		"sent yet instead of queueing the same report again");
+
+static struct workqueue_struct *usbhid_input_wq;
+
 /* Quirks specified at module load time */
 static char *quirks_param[MAX_USBHID_BOOT_QUIRKS] = { [ 0 ... (MAX_USBHID_BOOT_QUIRKS - 1) ] = NULL };
 module_param_array_named(quirks, quirks_param, charp, NULL, 0444);
@@ -76,26 +93,81 @@ static int hid_submit_out(struct hid_device *hid);
 static int hid_submit_ctrl(struct hid_device *hid);
 static void hid_cancel_delayed_stuff(struct usbhid_device *usbhid);
 
-/* Start up the input URB */
+/*
+ * Several input URBs may be queued on the interrupt endpoint, so that the
+ * host keeps polling the device while a report is being processed. The
+ * host controller completes them in order. HID_IN_RUNNING is set while at
+ * least one of them is in flight.
+ */
+
+static unsigned int hid_in_urb_index(struct usbhid_device *usbhid,
+				     struct urb *urb)
+{
+	unsigned int n;
+
+	for (n = 0; n < usbhid->num_urbin - 1; n++)
+		if (usbhid->urbin[n] == urb)
+			break;
+	return n;
+}
+
+static void hid_in_urb_stopped(struct usbhid_device *usbhid, unsigned int n)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&usbhid->lock, flags);
+	clear_bit(n, &usbhid->in_busy);
+	if (!usbhid->in_busy)
+		clear_bit(HID_IN_RUNNING, &usbhid->iofl);
+	spin_unlock_irqrestore(&usbhid->lock, flags);
+}
+
+static void hid_kill_in_urbs(struct usbhid_device *usbhid)
+{
+	unsigned int n;
+
+	for (n = 0; n < usbhid->num_urbin; n++)
+		usb_kill_urb(usbhid->urbin[n]);
+}
+
+/*
+ * Start up the input URBs. Failing to submit some of them is not an error
+ * as long as one is in flight: input keeps running, with fewer URBs.
+ */
 static int hid_start_in(struct hid_device *hid)
 {
 	unsigned long flags;
+	unsigned int n;
 	int rc = 0;
 	struct usbhid_device *usbhid = hid->driver_data;
 
 	spin_lock_irqsave(&usbhid->lock, flags);
 	if (hid->open > 0 &&
 			!test_bit(HID_DISCONNECTED, &usbhid->iofl) &&
-			!test_bit(HID_SUSPENDED, &usbhid->iofl) &&
-			!test_and_set_bit(HID_IN_RUNNING, &usbhid->iofl)) {
-		rc = usb_submit_urb(usbhid->urbin, GFP_ATOMIC);
-		if (rc != 0) {
-			clear_bit(HID_IN_RUNNING, &usbhid->iofl);
-			if (rc == -ENOSPC)
-				set_bit(HID_NO_BANDWIDTH, &usbhid->iofl);
+			!test_bit(HID_SUSPENDED, &usbhid->iofl)) {
+		for (n = 0; n < usbhid->num_urbin; n++) {
+			if (test_and_set_bit(n, &usbhid->in_busy))
+				continue;
+			rc = usb_submit_urb(usbhid->urbin[n], GFP_ATOMIC);
+			if (rc != 0) {
+				clear_bit(n, &usbhid->in_busy);
+				break;
+			}
+		}
+		if (usbhid->in_busy) {
+			if (rc)
+				dev_dbg(&usbhid->intf->dev,
+					"input URB %u not submitted: %d\n",
+					n, rc);
+			rc = 0;
+			set_bit(HID_IN_RUNNING, &usbhid->iofl);
 		} else {
-			clear_bit(HID_NO_BANDWIDTH, &usbhid->iofl);
+			clear_bit(HID_IN_RUNNING, &usbhid->iofl);
 		}
+		if (rc == -ENOSPC)
+			set_bit(HID_NO_BANDWIDTH, &usbhid->iofl);
+		else if (rc == 0)
+			clear_bit(HID_NO_BANDWIDTH, &usbhid->iofl);
 	}
 	spin_unlock_irqrestore(&usbhid->lock, flags);
 	return rc;
@@ -122,7 +194,7 @@ static void hid_reset(struct work_struct *work)
 
 	if (test_bit(HID_CLEAR_HALT, &usbhid->iofl)) {
 		dev_dbg(&usbhid->intf->dev, "clear halt\n");
-		rc = usb_clear_halt(hid_to_usb_dev(hid), usbhid->urbin->pipe);
+		rc = usb_clear_halt(hid_to_usb_dev(hid), usbhid->urbin[0]->pipe);
 		clear_bit(HID_CLEAR_HALT, &usbhid->iofl);
 		hid_start_in(hid);
 	}
@@ -284,46 +356,158 @@ static int usbhid_restart_ctrl_queue(struct usbhid_device *usbhid)
  * Input interrupt completion handler.
  */
 
+/*
+ * If no other input URB was queued while this one was processed, the
+ * endpoint was not polled in the meantime: account for the intervals lost.
+ */
+static void hid_account_missed(struct usbhid_device *usbhid, unsigned int n,
+			       ktime_t start)
+{
+	unsigned long flags;
+	s64 elapsed;
+
+	if (!usbhid->in_period_us)
+		return;
+
+	elapsed = ktime_us_delta(ktime_get(), start);
+	if (elapsed < usbhid->in_period_us)
+		return;
+
+	spin_lock_irqsave(&usbhid->lock, flags);
+	if (!(usbhid->in_busy & ~(1UL << n)))
+		usbhid->in_missed += div_u64(elapsed, usbhid->in_period_us);
+	spin_unlock_irqrestore(&usbhid->lock, flags);
+}
+
+/*
+ * autosuspend refused while keys are pressed
+ * because most keyboards don't wake up when
+ * a key is released
+ */
+static void hid_update_keys_pressed(struct hid_device *hid)
+{
+	struct usbhid_device *usbhid = hid->driver_data;
+
+	if (hid_check_keys_pressed(hid))
+		set_bit(HID_KEYS_PRESSED, &usbhid->iofl);
+	else
+		clear_bit(HID_KEYS_PRESSED, &usbhid->iofl);
+}
+
+/*
+ * Deferred input processing. With HID_QUIRK_DEFERRED_INPUT, hid_irq_in()
+ * only copies the report into a single producer, single consumer ring and
+ * resubmits the URB; hid_in_work() processes the queued reports in a
+ * workqueue, in order and in batches.
+ */
+
+/*
+ * Size of a report buffer slot: bufsize bytes plus the 7 bytes extract()
+ * and implement() may access past the data, as they work on 8 byte chunks.
+ */
+static unsigned int hid_buf_stride(struct usbhid_device *usbhid)
+{
+	return ALIGN(usbhid->bufsize + 7, sizeof(long));
+}
+
+static void hid_queue_in(struct usbhid_device *usbhid, u8 *data,
+			 unsigned int len, ktime_t arrival)
+{
+	unsigned int head = usbhid->in_ring_head;
+	unsigned int next = (head + 1) % HID_IN_RING_SLOTS;
+
+	if (next == ACCESS_ONCE(usbhid->in_ring_tail)) {
+		usbhid->in_ring_dropped++;
+		goto kick;
+	}
+
+	/* the consumer is done with the slot before we overwrite it */
+	smp_mb();
+
+	len = min(len, usbhid->bufsize);
+	memcpy(usbhid->in_ring + head * hid_buf_stride(usbhid), data, len);
+	usbhid->in_ring_len[head] = len;
+	usbhid->in_ring_time[head] = ktime_to_ns(arrival);
+
+	/* publish the report before the new head */
+	smp_wmb();
+	ACCESS_ONCE(usbhid->in_ring_head) = next;
+
+kick:
+	if (hid_deferred_cpu >= 0 && cpu_online(hid_deferred_cpu))
+		queue_work_on(hid_deferred_cpu, usbhid_input_wq,
+			      &usbhid->in_work);
+	else
+		queue_work(usbhid_input_wq, &usbhid->in_work);
+}
+
+static void hid_in_work(struct work_struct *work)
+{
+	struct usbhid_device *usbhid =
+		container_of(work, struct usbhid_device, in_work);
+	struct hid_device *hid = usbhid->hid;
+	unsigned int stride = hid_buf_stride(usbhid);
+	unsigned int tail = usbhid->in_ring_tail;
+
+	while (tail != ACCESS_ONCE(usbhid->in_ring_head)) {
+		/* read the report after the head */
+		smp_rmb();
+		hid_input_report_timestamp(hid, HID_INPUT_REPORT,
+					   usbhid->in_ring + tail * stride,
+					   usbhid->in_ring_len[tail], 1,
+					   usbhid->in_ring_time[tail]);
+
+		tail = (tail + 1) % HID_IN_RING_SLOTS;
+		/* release the slot once the report has been processed */
+		smp_mb();
+		ACCESS_ONCE(usbhid->in_ring_tail) = tail;
+	}
+
+	hid_update_keys_pressed(hid);
+}
+
 static void hid_irq_in(struct urb *urb)
 {
 	struct hid_device	*hid = urb->context;
 	struct usbhid_device 	*usbhid = hid->driver_data;
+	unsigned int		n = hid_in_urb_index(usbhid, urb);
+	bool			received = false;
+	ktime_t			start = ktime_set(0, 0);
 	int			status;
 
 	switch (urb->status) {
 	case 0:			/* success */
+		start = ktime_get();
+		received = true;
 		usbhid_mark_busy(usbhid);
 		usbhid->retry_delay = 0;
+		if (usbhid->in_ring) {
+			hid_queue_in(usbhid, urb->transfer_buffer,
+				     urb->actual_length, start);
+			break;
+		}
 		hid_input_report(urb->context, HID_INPUT_REPORT,
 				 urb->transfer_buffer,
 				 urb->actual_length, 1);
-		/*
-		 * autosuspend refused while keys are pressed
-		 * because most keyboards don't wake up when
-		 * a key is released
-		 */
-		if (hid_check_keys_pressed(hid))
-			set_bit(HID_KEYS_PRESSED, &usbhid->iofl);
-		else
-			clear_bit(HID_KEYS_PRESSED, &usbhid->iofl);
+		hid_update_keys_pressed(hid);
 		break;
 	case -EPIPE:		/* stall */
 		usbhid_mark_busy(usbhid);
-		clear_bit(HID_IN_RUNNING, &usbhid->iofl);
+		hid_in_urb_stopped(usbhid, n);
 		set_bit(HID_CLEAR_HALT, &usbhid->iofl);
 		schedule_work(&usbhid->reset_work);
 		return;
 	case -ECONNRESET:	/* unlink */
 	case -ENOENT:
 	case -ESHUTDOWN:	/* unplug */
-		clear_bit(HID_IN_RUNNING, &usbhid->iofl);
+		hid_in_urb_stopped(usbhid, n);
 		return;
 	case -EILSEQ:		/* protocol error or unplug */
 	case -EPROTO:		/* protocol error or unplug */
 	case -ETIME:		/* protocol error or unplug */
 	case -ETIMEDOUT:	/* Should never happen, but... */
 		usbhid_mark_busy(usbhid);
-		clear_bit(HID_IN_RUNNING, &usbhid->iofl);
+		hid_in_urb_stopped(usbhid, n);
 		hid_io_error(hid);
 		return;
 	default:		/* error */
@@ -333,7 +517,7 @@ static void hid_irq_in(struct urb *urb)
 
 	status = usb_submit_urb(urb, GFP_ATOMIC);
 	if (status) {
-		clear_bit(HID_IN_RUNNING, &usbhid->iofl);
+		hid_in_urb_stopped(usbhid, n);
 		if (status != -EPERM) {
 			hid_err(hid, "can't resubmit intr, %s-%s/input%d, status %d\n",
 				hid_to_usb_dev(hid)->bus->bus_name,
@@ -341,9 +525,20 @@ static void hid_irq_in(struct urb *urb)
 				usbhid->ifnum, status);
 			hid_io_error(hid);
 		}
+	} else if (received) {
+		hid_account_missed(usbhid, n, start);
 	}
 }
 
+/*
+ * Length of the data hid_output_report() writes for a report, which is
+ * what gets copied into the URB buffer on submission.
+ */
+static unsigned int hid_report_len(struct hid_report *report)
+{
+	return ((report->size - 1) >> 3) + 1 + (report->id > 0);
+}
+
 static int hid_submit_out(struct hid_device *hid)
 {
 	struct hid_report *report;
@@ -354,15 +549,10 @@ static int hid_submit_out(struct hid_device *hid)
 	report = usbhid->out[usbhid->outtail].report;
 	raw_report = usbhid->out[usbhid->outtail].raw_report;
 
-	usbhid->urbout->transfer_buffer_length = ((report->size - 1) >> 3) +
-						 1 + (report->id > 0);
+	usbhid->urbout->transfer_buffer_length = hid_report_len(report);
 	usbhid->urbout->dev = hid_to_usb_dev(hid);
-	if (raw_report) {
-		memcpy(usbhid->outbuf, raw_report,
-				usbhid->urbout->transfer_buffer_length);
-		kfree(raw_report);
-		usbhid->out[usbhid->outtail].raw_report = NULL;
-	}
+	memcpy(usbhid->outbuf, raw_report,
+			usbhid->urbout->transfer_buffer_length);
 
 	dbg_hid("submitting out urb\n");
 
@@ -387,15 +577,11 @@ static int hid_submit_ctrl(struct hid_device *hid)
 	raw_report = usbhid->ctrl[usbhid->ctrltail].raw_report;
 	dir = usbhid->ctrl[usbhid->ctrltail].dir;
 
-	len = ((report->size - 1) >> 3) + 1 + (report->id > 0);
+	len = hid_report_len(report);
 	if (dir == USB_DIR_OUT) {
 		usbhid->urbctrl->pipe = usb_sndctrlpipe(hid_to_usb_dev(hid), 0);
 		usbhid->urbctrl->transfer_buffer_length = len;
-		if (raw_report) {
-			memcpy(usbhid->ctrlbuf, raw_report, len);
-			kfree(raw_report);
-			usbhid->ctrl[usbhid->ctrltail].raw_report = NULL;
-		}
+		memcpy(usbhid->ctrlbuf, raw_report, len);
 	} else {
 		int maxpacket, padlen;
 
@@ -532,26 +718,83 @@ static void hid_ctrl(struct urb *urb)
 	wake_up(&usbhid->wait);
 }
 
+/*
+ * With the coalesce parameter set, look for a queued entry that a new
+ * request for the same report would supersede.  The entry at the tail
+ * is skipped while the queue is running: it has already been copied to
+ * the URB.  Returns the fifo index, or -1.
+ */
+static int hid_find_pending_out(struct usbhid_device *usbhid,
+				struct hid_report *report)
+{
+	int i = usbhid->outtail;
+
+	if (!hid_coalesce)
+		return -1;
+
+	if (test_bit(HID_OUT_RUNNING, &usbhid->iofl) && i != usbhid->outhead)
+		i = (i + 1) & (HID_OUTPUT_FIFO_SIZE - 1);
+
+	for (; i != usbhid->outhead; i = (i + 1) & (HID_OUTPUT_FIFO_SIZE - 1))
+		if (usbhid->out[i].report == report)
+			return i;
+
+	return -1;
+}
+
+static int hid_find_pending_ctrl(struct usbhid_device *usbhid,
+				 struct hid_report *report, unsigned char dir)
+{
+	int i = usbhid->ctrltail;
+
+	if (!hid_coalesce)
+		return -1;
+
+	if (test_bit(HID_CTRL_RUNNING, &usbhid->iofl) && i != usbhid->ctrlhead)
+		i = (i + 1) & (HID_CONTROL_FIFO_SIZE - 1);
+
+	for (; i != usbhid->ctrlhead; i = (i + 1) & (HID_CONTROL_FIFO_SIZE - 1))
+		if (usbhid->ctrl[i].report == report &&
+		    usbhid->ctrl[i].dir == dir)
+			return i;
+
+	return -1;
+}
+
 static void __usbhid_submit_report(struct hid_device *hid, struct hid_report *report,
 				   unsigned char dir)
 {
-	int head;
+	int head, pending;
 	struct usbhid_device *usbhid = hid->driver_data;
 
 	if ((hid->quirks & HID_QUIRK_NOGET) && dir == USB_DIR_IN)
 		return;
 
+	/* not started yet, or being stopped */
+	if (!usbhid->report_pool || test_bit(HID_DISCONNECTED, &usbhid->iofl))
+		return;
+
 	if (usbhid->urbout && dir == USB_DIR_OUT && report->type == HID_OUTPUT_REPORT) {
-		if ((head = (usbhid->outhead + 1) & (HID_OUTPUT_FIFO_SIZE - 1)) == usbhid->outtail) {
+		pending = hid_find_pending_out(usbhid, report);
+		head = (usbhid->outhead + 1) & (HID_OUTPUT_FIFO_SIZE - 1);
+		if (pending < 0 && head == usbhid->outtail) {
+			usbhid->out_dropped++;
 			hid_warn(hid, "output queue full\n");
 			return;
 		}
 
-		usbhid->out[usbhid->outhead].raw_report = hid_alloc_report_buf(report, GFP_ATOMIC);
-		if (!usbhid->out[usbhid->outhead].raw_report) {
+		if (hid_report_len(report) > usbhid->bufsize) {
 			hid_warn(hid, "output queueing failed\n");
 			return;
 		}
+
+		if (pending >= 0) {
+			/* Only the latest value matters, overwrite it */
+			hid_output_report(report, usbhid->out[pending].raw_report);
+			usbhid->coalesced++;
+			return;
+		}
+
 		hid_output_report(report, usbhid->out[usbhid->outhead].raw_report);
 		usbhid->out[usbhid->outhead].report = report;
 		usbhid->outhead = head;
@@ -590,18 +833,29 @@ static void __usbhid_submit_report(struct hid_device *hid, struct hid_report *re
 		return;
 	}
 
-	if ((head = (usbhid->ctrlhead + 1) & (HID_CONTROL_FIFO_SIZE - 1)) == usbhid->ctrltail) {
+	pending = hid_find_pending_ctrl(usbhid, report, dir);
+	head = (usbhid->ctrlhead + 1) & (HID_CONTROL_FIFO_SIZE - 1);
+	if (pending < 0 && head == usbhid->ctrltail) {
+		usbhid->ctrl_dropped++;
 		hid_warn(hid, "control queue full\n");
 		return;
 	}
 
 	if (dir == USB_DIR_OUT) {
-		usbhid->ctrl[usbhid->ctrlhead].raw_report = hid_alloc_report_buf(report, GFP_ATOMIC);
-		if (!usbhid->ctrl[usbhid->ctrlhead].raw_report) {
+		if (hid_report_len(report) > usbhid->bufsize) {
 			hid_warn(hid, "control queueing failed\n");
 			return;
 		}
+		if (pending >= 0) {
+			hid_output_report(report, usbhid->ctrl[pending].raw_report);
+			usbhid->coalesced++;
+			return;
+		}
 		hid_output_report(report, usbhid->ctrl[usbhid->ctrlhead].raw_report);
+	} else if (pending >= 0) {
+		/* The pending GET_REPORT will fetch the current value */
+		usbhid->coalesced++;
+		return;
 	}
 	usbhid->ctrl[usbhid->ctrlhead].report = report;
 	usbhid->ctrl[usbhid->ctrlhead].dir = dir;
@@ -736,7 +990,7 @@ void usbhid_close(struct hid_device *hid)
 	if (!--hid->open) {
 		spin_unlock_irq(&usbhid->lock);
 		hid_cancel_delayed_stuff(usbhid);
-		usb_kill_urb(usbhid->urbin);
+		hid_kill_in_urbs(usbhid);
 		usbhid->intf->needs_remote_wakeup = 0;
 	} else {
 		spin_unlock_irq(&usbhid->lock);
@@ -834,19 +1088,79 @@ static void hid_find_max_report(struct hid_device *hid, unsigned int type,
 	}
 }
 
+/*
+ * Every slot of the output and control fifos owns a buffer of bufsize
+ * bytes, plus the 7 bytes of slack implement() needs (see
+ * hid_alloc_report_buf()), so that queueing a report does not have to
+ * allocate in atomic context.
+ */
+#define HID_POOL_SLOTS		(HID_OUTPUT_FIFO_SIZE + HID_CONTROL_FIFO_SIZE)
+
+/*
+ * report_pool is set and cleared under usbhid->lock, and
+ * __usbhid_submit_report() does not queue anything without it.
+ */
+static int hid_alloc_report_pool(struct usbhid_device *usbhid)
+{
+	unsigned int stride = hid_buf_stride(usbhid);
+	unsigned long flags;
+	unsigned int n;
+	char *pool, *p;
+
+	pool = vmalloc(HID_POOL_SLOTS * stride);
+	if (!pool)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&usbhid->lock, flags);
+	p = pool;
+	for (n = 0; n < HID_OUTPUT_FIFO_SIZE; n++, p += stride)
+		usbhid->out[n].raw_report = p;
+	for (n = 0; n < HID_CONTROL_FIFO_SIZE; n++, p += stride)
+		usbhid->ctrl[n].raw_report = p;
+	usbhid->report_pool = pool;
+	spin_unlock_irqrestore(&usbhid->lock, flags);
+
+	return 0;
+}
+
+static void hid_free_report_pool(struct usbhid_device *usbhid)
+{
+	unsigned long flags;
+	unsigned int n;
+	char *pool;
+
+	spin_lock_irqsave(&usbhid->lock, flags);
+	pool = usbhid->report_pool;
+	usbhid->report_pool = NULL;
+	for (n = 0; n < HID_OUTPUT_FIFO_SIZE; n++)
+		usbhid->out[n].raw_report = NULL;
+	for (n = 0; n < HID_CONTROL_FIFO_SIZE; n++)
+		usbhid->ctrl[n].raw_report = NULL;
+	spin_unlock_irqrestore(&usbhid->lock, flags);
+
+	vfree(pool);
+}
+
 static int hid_alloc_buffers(struct usb_device *dev, struct hid_device *hid)
 {
 	struct usbhid_device *usbhid = hid->driver_data;
+	unsigned int n;
 
-	usbhid->inbuf = usb_alloc_coherent(dev, usbhid->bufsize, GFP_KERNEL,
-			&usbhid->inbuf_dma);
+	for (n = 0; n < usbhid->num_urbin; n++) {
+		usbhid->inbuf[n] = usb_alloc_coherent(dev, usbhid->bufsize,
+				GFP_KERNEL, &usbhid->inbuf_dma[n]);
+		if (!usbhid->inbuf[n])
+			return -1;
+	}
 	usbhid->outbuf = usb_alloc_coherent(dev, usbhid->bufsize, GFP_KERNEL,
 			&usbhid->outbuf_dma);
 	usbhid->cr = kmalloc(sizeof(*usbhid->cr), GFP_KERNEL);
 	usbhid->ctrlbuf = usb_alloc_coherent(dev, usbhid->bufsize, GFP_KERNEL,
 			&usbhid->ctrlbuf_dma);
-	if (!usbhid->inbuf || !usbhid->outbuf || !usbhid->cr ||
-			!usbhid->ctrlbuf)
+	if (!usbhid->outbuf || !usbhid->cr || !usbhid->ctrlbuf)
+		return -1;
+
+	if (hid_alloc_report_pool(usbhid))
 		return -1;
 
 	return 0;
@@ -949,11 +1263,17 @@ static void usbhid_restart_queues(struct usbhid_device *usbhid)
 static void hid_free_buffers(struct usb_device *dev, struct hid_device *hid)
 {
 	struct usbhid_device *usbhid = hid->driver_data;
+	unsigned int n;
 
-	usb_free_coherent(dev, usbhid->bufsize, usbhid->inbuf, usbhid->inbuf_dma);
+	for (n = 0; n < usbhid->num_urbin; n++) {
+		usb_free_coherent(dev, usbhid->bufsize, usbhid->inbuf[n],
+				  usbhid->inbuf_dma[n]);
+		usbhid->inbuf[n] = NULL;
+	}
 	usb_free_coherent(dev, usbhid->bufsize, usbhid->outbuf, usbhid->outbuf_dma);
 	kfree(usbhid->cr);
 	usb_free_coherent(dev, usbhid->bufsize, usbhid->ctrlbuf, usbhid->ctrlbuf_dma);
+	hid_free_report_pool(usbhid);
 }
 
 static int usbhid_parse(struct hid_device *hid)
@@ -1029,13 +1349,45 @@ err:
 	return ret;
 }
 
+/* Read-only statistics counters, in the usbhid_stat_group sysfs group */
+#define USBHID_STAT_ATTR(_name, _field)					\
+static ssize_t show_##_name(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct hid_device *hid = container_of(dev, struct hid_device, dev); \
+	struct usbhid_device *usbhid = hid->driver_data;		\
+									\
+	return sprintf(buf, "%lu\n", usbhid->_field);			\
+}									\
+static DEVICE_ATTR(_name, S_IRUGO, show_##_name, NULL)
+
+USBHID_STAT_ATTR(missed_intervals, in_missed);
+USBHID_STAT_ATTR(input_dropped, in_ring_dropped);
+USBHID_STAT_ATTR(output_dropped, out_dropped);
+USBHID_STAT_ATTR(control_dropped, ctrl_dropped);
+USBHID_STAT_ATTR(coalesced, coalesced);
+
+static struct attribute *usbhid_stat_attrs[] = {
+	&dev_attr_missed_intervals.attr,
+	&dev_attr_input_dropped.attr,
+	&dev_attr_output_dropped.attr,
+	&dev_attr_control_dropped.attr,
+	&dev_attr_coalesced.attr,
+	NULL
+};
+
+static const struct attribute_group usbhid_stat_group = {
+	.attrs = usbhid_stat_attrs,
+};
+
 static int usbhid_start(struct hid_device *hid)
 {
 	struct usb_interface *intf = to_usb_interface(hid->dev.parent);
 	struct usb_host_interface *interface = intf->cur_altsetting;
 	struct usb_device *dev = interface_to_usbdev(intf);
 	struct usbhid_device *usbhid = hid->driver_data;
-	unsigned int n, insize = 0;
+	unsigned int n, i, insize = 0;
+	struct urb *urb;
 	int ret;
 
 	clear_bit(HID_DISCONNECTED, &usbhid->iofl);
@@ -1053,6 +1405,21 @@ static int usbhid_start(struct hid_device *hid)
 	if (insize > HID_MAX_BUFFER_SIZE)
 		insize = HID_MAX_BUFFER_SIZE;
 
+	usbhid->num_urbin = clamp_t(unsigned int, hid_in_urbs, 1,
+				    HID_MAX_IN_URBS);
+	usbhid->in_busy = 0;
+	usbhid->in_missed = 0;
+
+	if (hid->quirks & HID_QUIRK_DEFERRED_INPUT) {
+		usbhid->in_ring = vmalloc(HID_IN_RING_SLOTS *
+					  hid_buf_stride(usbhid));
+		if (!usbhid->in_ring)
+			hid_warn(hid, "no memory for deferred input, processing it inline\n");
+		usbhid->in_ring_head = 0;
+		usbhid->in_ring_tail = 0;
+		usbhid->in_ring_dropped = 0;
+	}
+
 	if (hid_alloc_buffers(dev, hid)) {
 		ret = -ENOMEM;
 		goto fail;
@@ -1083,15 +1450,23 @@ static int usbhid_start(struct hid_device *hid)
 
 		ret = -ENOMEM;
 		if (usb_endpoint_dir_in(endpoint)) {
-			if (usbhid->urbin)
+			if (usbhid->urbin[0])
 				continue;
-			if (!(usbhid->urbin = usb_alloc_urb(0, GFP_KERNEL)))
-				goto fail;
 			pipe = usb_rcvintpipe(dev, endpoint->bEndpointAddress);
-			usb_fill_int_urb(usbhid->urbin, dev, pipe, usbhid->inbuf, insize,
-					 hid_irq_in, hid, interval);
-			usbhid->urbin->transfer_dma = usbhid->inbuf_dma;
-			usbhid->urbin->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+			for (i = 0; i < usbhid->num_urbin; i++) {
+				urb = usb_alloc_urb(0, GFP_KERNEL);
+				if (!urb)
+					goto fail;
+				usbhid->urbin[i] = urb;
+				usb_fill_int_urb(urb, dev, pipe, usbhid->inbuf[i],
+						 insize, hid_irq_in, hid, interval);
+				urb->transfer_dma = usbhid->inbuf_dma[i];
+				urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+			}
+			/* the interval is in microframes at high speed */
+			usbhid->in_period_us = usbhid->urbin[0]->interval *
+				(dev->speed == USB_SPEED_HIGH ||
+				 dev->speed == USB_SPEED_SUPER ? 125 : 1000);
 		} else {
 			if (usbhid->urbout)
 				continue;
@@ -1121,6 +1496,11 @@ static int usbhid_start(struct hid_device *hid)
 
 	set_bit(HID_STARTED, &usbhid->iofl);
 
+	usbhid->stat_group = !sysfs_create_group(&hid->dev.kobj,
+						 &usbhid_stat_group);
+	if (!usbhid->stat_group)
+		hid_warn(hid, "can't create statistics attributes\n");
+
 	/* Some keyboards don't work until their LEDs have been set.
 	 * Since BIOSes do set the LEDs, it must be safe for any device
 	 * that supports the keyboard boot protocol.
@@ -1136,10 +1516,14 @@ static int usbhid_start(struct hid_device *hid)
 	return 0;
 
 fail:
-	usb_free_urb(usbhid->urbin);
+	for (i = 0; i < usbhid->num_urbin; i++) {
+		usb_free_urb(usbhid->urbin[i]);
+		usbhid->urbin[i] = NULL;
+	}
 	usb_free_urb(usbhid->urbout);
 	usb_free_urb(usbhid->urbctrl);
-	usbhid->urbin = NULL;
+	vfree(usbhid->in_ring);
+	usbhid->in_ring = NULL;
 	usbhid->urbout = NULL;
 	usbhid->urbctrl = NULL;
 	hid_free_buffers(dev, hid);
@@ -1149,26 +1533,37 @@ fail:
 static void usbhid_stop(struct hid_device *hid)
 {
 	struct usbhid_device *usbhid = hid->driver_data;
+	unsigned int i;
 
 	if (WARN_ON(!usbhid))
 		return;
 
+	if (usbhid->stat_group) {
+		sysfs_remove_group(&hid->dev.kobj, &usbhid_stat_group);
+		usbhid->stat_group = false;
+	}
+
 	clear_bit(HID_STARTED, &usbhid->iofl);
 	spin_lock_irq(&usbhid->lock);	/* Sync with error and led handlers */
 	set_bit(HID_DISCONNECTED, &usbhid->iofl);
 	spin_unlock_irq(&usbhid->lock);
-	usb_kill_urb(usbhid->urbin);
+	hid_kill_in_urbs(usbhid);
 	usb_kill_urb(usbhid->urbout);
 	usb_kill_urb(usbhid->urbctrl);
 
 	hid_cancel_delayed_stuff(usbhid);
+	cancel_work_sync(&usbhid->in_work);
+	vfree(usbhid->in_ring);
+	usbhid->in_ring = NULL;
 
 	hid->claimed = 0;
 
-	usb_free_urb(usbhid->urbin);
+	for (i = 0; i < usbhid->num_urbin; i++) {
+		usb_free_urb(usbhid->urbin[i]);
+		usbhid->urbin[i] = NULL; /* don't mess up next start */
+	}
 	usb_free_urb(usbhid->urbctrl);
 	usb_free_urb(usbhid->urbout);
-	usbhid->urbin = NULL; /* don't mess up next start */
 	usbhid->urbctrl = NULL;
 	usbhid->urbout = NULL;
 
@@ -1307,6 +1702,7 @@ static int usbhid_probe(struct usb_interface *intf, const struct usb_device_id *
 
 	init_waitqueue_head(&usbhid->wait);
 	INIT_WORK(&usbhid->reset_work, hid_reset);
+	INIT_WORK(&usbhid->in_work, hid_in_work);
 	setup_timer(&usbhid->io_retry, hid_retry_timeout, (unsigned long) hid);
 	spin_lock_init(&usbhid->lock);
 
@@ -1347,7 +1743,7 @@ static void hid_cancel_delayed_stuff(struct usbhid_device *usbhid)
 static void hid_cease_io(struct usbhid_device *usbhid)
 {
 	del_timer_sync(&usbhid->io_retry);
-	usb_kill_urb(usbhid->urbin);
+	hid_kill_in_urbs(usbhid);
 	usb_kill_urb(usbhid->urbctrl);
 	usb_kill_urb(usbhid->urbout);
 }
@@ -1579,6 +1975,22 @@ static int __init hid_init(void)
 {
 	int retval = -ENOMEM;
 
+	/*
+	 * deferredcpu can change while in_work is running, and hid_in_work()
+	 * must never run concurrently with itself: it is the only consumer of
+	 * the ring. That is the default since 3.7.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+	usbhid_input_wq = alloc_workqueue("usbhid_input", WQ_HIGHPRI, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	usbhid_input_wq = alloc_workqueue("usbhid_input",
+					  WQ_HIGHPRI | WQ_NON_REENTRANT, 0);
+#else
+	usbhid_input_wq = create_singlethread_workqueue("usbhid_input");
+#endif
+	if (!usbhid_input_wq)
+		goto usbhid_input_wq_fail;
+
 	retval = usbhid_quirks_init(quirks_param);
 	if (retval)
 		goto usbhid_quirks_init_fail;
@@ -1591,6 +2003,8 @@ static int __init hid_init(void)
 usb_register_fail:
 	usbhid_quirks_exit();
 usbhid_quirks_init_fail:
+	destroy_workqueue(usbhid_input_wq);
+usbhid_input_wq_fail:
 	return retval;
 }
 
@@ -1598,6 +2012,7 @@ static void __exit hid_exit(void)
 {
 	usb_deregister(&hid_driver);
 	usbhid_quirks_exit();
+	destroy_workqueue(usbhid_input_wq);
 }
 
 module_init(hid_init);
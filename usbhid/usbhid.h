@@ -53,6 +53,9 @@ struct usb_interface *usbhid_find_interface(int minor);
 #define HID_KEYS_PRESSED	10
 #define HID_NO_BANDWIDTH	11
 
+#define HID_MAX_IN_URBS		8	/* interrupt-in URBs kept in flight */
+#define HID_IN_RING_SLOTS	32	/* reports queued for deferred processing */
+
 /*
  * USB-specific HID struct, to be pointed to
  * from struct hid_device->driver_data
@@ -66,9 +69,22 @@ struct usbhid_device {
 
 	unsigned int bufsize;                                           /* URB buffer size */
 
-	struct urb *urbin;                                              /* Input URB */
-	char *inbuf;                                                    /* Input buffer */
-	dma_addr_t inbuf_dma;                                           /* Input buffer dma */
+	struct urb *urbin[HID_MAX_IN_URBS];                             /* Input URBs */
+	char *inbuf[HID_MAX_IN_URBS];                                   /* Input buffers */
+	dma_addr_t inbuf_dma[HID_MAX_IN_URBS];                          /* Input buffers dma */
+	unsigned int num_urbin;                                         /* Number of input URBs */
+	unsigned long in_busy;                                          /* Input URBs in flight, protected by lock */
+	unsigned int in_period_us;                                      /* Polling interval of the input endpoint */
+	unsigned long in_missed;                                        /* Polling intervals missed while no URB was queued */
+
+	/* deferred input processing, see HID_QUIRK_DEFERRED_INPUT */
+	u8 *in_ring;                                                    /* HID_IN_RING_SLOTS reports, hid_buf_stride() apart */
+	unsigned int in_ring_len[HID_IN_RING_SLOTS];                    /* Length of each queued report */
+	u64 in_ring_time[HID_IN_RING_SLOTS];                            /* Arrival time of each queued report, ns */
+	unsigned int in_ring_head;                                      /* Written by hid_irq_in() only */
+	unsigned int in_ring_tail;                                      /* Written by hid_in_work() only */
+	unsigned long in_ring_dropped;                                  /* Reports lost because the ring was full */
+	struct work_struct in_work;                                     /* Processes the queued reports */
 
 	struct urb *urbctrl;                                            /* Control URB */
 	struct usb_ctrlrequest *cr;                                     /* Control request struct */
@@ -88,6 +104,12 @@ struct usbhid_device {
 	dma_addr_t outbuf_dma;                                          /* Output buffer dma */
 	unsigned long last_out;							/* record of last output for timeouts */
 
+	char *report_pool;                                              /* Preallocated raw_report buffers of both fifos */
+	unsigned long out_dropped;                                      /* Output reports lost because the fifo was full */
+	unsigned long ctrl_dropped;                                     /* Control requests lost because the fifo was full */
+	unsigned long coalesced;                                        /* Requests merged into a pending entry */
+	bool stat_group;                                                /* usbhid_stat_group was created */
+
 	spinlock_t lock;						/* fifo spinlock */
 	unsigned long iofl;                                             /* I/O flags (CTRL_RUNNING, OUT_RUNNING) */
 	struct timer_list io_retry;                                     /* Retry timer */